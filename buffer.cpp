@@ -1,53 +1,369 @@
 #include "buffer.hpp"
 
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <map>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <future>
+
 #include <glad/glad.h>
+#include <GLFW/glfw3.h>
 
 #include "program.hpp"
 #include "input.hpp"
 #include "utility.hpp"
 #include "bvh.hpp"
+#include "terrain.hpp"
 
 
 
-void CreateBuffer(const char* const name, int binding, int datasize, void* data)
+struct RegisteredBuffer
+{
+	GLenum target;
+	GLuint binding;
+	GLuint buffer;
+	GLsizeiptr size;
+	GLenum usage; // 0 for immutable glBufferStorage buffers, those can not be resized
+};
+
+struct RegisteredTexture
+{
+	GLuint texture;
+};
+
+// std::map so the memory report comes out sorted by name
+static std::map<std::string, RegisteredBuffer> bufferRegistry;
+static std::map<std::string, RegisteredTexture> textureRegistry;
+
+static void TrackBuffer(const char* name, const RegisteredBuffer& registered)
+{
+	auto existing = bufferRegistry.find(name);
+	if (existing != bufferRegistry.end() && existing->second.buffer != registered.buffer)
+		glDeleteBuffers(1, &existing->second.buffer);
+	bufferRegistry[name] = registered;
+}
+
+GLuint CreateRegisteredBuffer(const char* name, GLenum target, GLuint binding, GLsizeiptr size, const void* data, GLenum usage)
 {
 	GLuint buffer;
 	glGenBuffers(1, &buffer);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, datasize, data, GL_STATIC_DRAW);
+	glBindBuffer(target, buffer);
+	glBufferData(target, size, data, usage);
+	glBindBufferBase(target, binding, buffer);
+	TrackBuffer(name, { target, binding, buffer, size, usage });
+	return buffer;
+}
+
+GLuint ResizeRegisteredBuffer(const char* name, GLsizeiptr size)
+{
+	auto existing = bufferRegistry.find(name);
+	if (existing == bufferRegistry.end())
+	{
+		std::cout << "ResizeRegisteredBuffer: no buffer named " << name << "\n";
+		return 0;
+	}
+	RegisteredBuffer& registered = existing->second;
+	if (size <= registered.size)
+		return registered.buffer;
+	if (registered.usage == 0)
+	{
+		std::cout << "ResizeRegisteredBuffer: " << name << " has immutable storage\n";
+		return registered.buffer;
+	}
+
+	// Grow by at least half so repeated small resizes don't copy every time
+	GLsizeiptr newSize = std::max(size, registered.size + registered.size / 2);
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, newSize, NULL, registered.usage);
+	glBindBuffer(GL_COPY_READ_BUFFER, registered.buffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, registered.size);
+	glDeleteBuffers(1, &registered.buffer);
+	glBindBufferBase(registered.target, registered.binding, buffer);
+
+	registered.buffer = buffer;
+	registered.size = newSize;
+	return buffer;
+}
+
+GLuint GetRegisteredBuffer(const char* name)
+{
+	auto existing = bufferRegistry.find(name);
+	return existing != bufferRegistry.end() ? existing->second.buffer : 0;
+}
+
+void DeleteRegisteredBuffer(const char* name)
+{
+	auto existing = bufferRegistry.find(name);
+	if (existing == bufferRegistry.end())
+		return;
+	glDeleteBuffers(1, &existing->second.buffer);
+	bufferRegistry.erase(existing);
+}
+
+void DeleteAllRegisteredBuffers()
+{
+	for (auto& registered : bufferRegistry)
+		glDeleteBuffers(1, &registered.second.buffer);
+	bufferRegistry.clear();
+	for (auto& registered : textureRegistry)
+		glDeleteTextures(1, &registered.second.texture);
+	textureRegistry.clear();
+}
+
+void RegisterTexture(const char* name, GLuint texture)
+{
+	textureRegistry[name] = { texture };
+}
+
+static GLsizeiptr TextureSize(GLuint texture)
+{
+	// Sum every mip level, the texel size comes from the component sizes of the internal format
+	GLsizeiptr size = 0;
+	for (int level = 0; ; level++)
+	{
+		GLint width = 0;
+		GLint height = 0;
+		GLint depth = 0; // Layers of array textures
+		glGetTextureLevelParameteriv(texture, level, GL_TEXTURE_WIDTH, &width);
+		glGetTextureLevelParameteriv(texture, level, GL_TEXTURE_HEIGHT, &height);
+		glGetTextureLevelParameteriv(texture, level, GL_TEXTURE_DEPTH, &depth);
+		if (width == 0 || height == 0)
+			break;
+		const GLenum componentSizes[] = {
+			GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE,
+			GL_TEXTURE_ALPHA_SIZE, GL_TEXTURE_DEPTH_SIZE, GL_TEXTURE_STENCIL_SIZE,
+		};
+		GLint bits = 0;
+		for (GLenum component : componentSizes)
+		{
+			GLint componentBits = 0;
+			glGetTextureLevelParameteriv(texture, level, component, &componentBits);
+			bits += componentBits;
+		}
+		size += (GLsizeiptr)width * height * depth * bits / 8;
+	}
+	return size;
+}
+
+void PrintGPUMemoryReport()
+{
+	const double MB = 1024.0 * 1024.0;
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "GPU memory:\n";
+
+	GLsizeiptr bufferTotal = 0;
+	for (const auto& registered : bufferRegistry)
+	{
+		std::cout << "  " << std::left << std::setw(24) << registered.first << std::right
+			<< " binding " << std::setw(2) << registered.second.binding
+			<< std::setw(10) << registered.second.size / MB << " MB\n";
+		bufferTotal += registered.second.size;
+	}
+	GLsizeiptr textureTotal = 0;
+	for (const auto& registered : textureRegistry)
+	{
+		GLsizeiptr size = TextureSize(registered.second.texture);
+		std::cout << "  " << std::left << std::setw(24) << registered.first << std::right
+			<< " texture   " << std::setw(10) << size / MB << " MB\n";
+		textureTotal += size;
+	}
+
+	std::cout << "  Buffers  " << bufferTotal / MB << " MB\n";
+	std::cout << "  Textures " << textureTotal / MB << " MB\n";
+	std::cout << "  Total    " << (bufferTotal + textureTotal) / MB << " MB\n";
+	std::cout.unsetf(std::ios::floatfield);
+}
+
+
+
+static void WaitAndDeleteFence(GLsync& fence)
+{
+	if (!fence)
+		return;
+	while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+	glDeleteSync(fence);
+	fence = 0;
+}
+
+// Uploads go through two persistently mapped chunks, the cpu fills one while
+// the gpu copies the other into the destination buffer
+const GLsizeiptr stagingChunkSize = 8 * 1024 * 1024;
+static GLuint stagingBuffer = 0;
+static char* stagingMapped = nullptr;
+static GLsync stagingFences[2] = {};
+
+void UploadBufferData(GLuint buffer, GLintptr offset, GLsizeiptr size, const void* data)
+{
+	if (!stagingBuffer)
+	{
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &stagingBuffer);
+		glBindBuffer(GL_COPY_READ_BUFFER, stagingBuffer);
+		glBufferStorage(GL_COPY_READ_BUFFER, stagingChunkSize * 2, NULL, flags);
+		stagingMapped = (char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, stagingChunkSize * 2, flags);
+		TrackBuffer("staging_buffer", { GL_COPY_READ_BUFFER, 0, stagingBuffer, stagingChunkSize * 2, 0 });
+	}
+
+	glBindBuffer(GL_COPY_READ_BUFFER, stagingBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	int chunk = 0;
+	for (GLsizeiptr uploaded = 0; uploaded < size; uploaded += stagingChunkSize)
+	{
+		GLsizeiptr chunkSize = std::min(stagingChunkSize, size - uploaded);
+		// Only waits if the gpu is still copying what was written here two chunks ago
+		WaitAndDeleteFence(stagingFences[chunk]);
+		memcpy(stagingMapped + chunk * stagingChunkSize, (const char*)data + uploaded, chunkSize);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, chunk * stagingChunkSize, offset + uploaded, chunkSize);
+		stagingFences[chunk] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		chunk ^= 1;
+	}
+}
+
+void FinishUploads()
+{
+	WaitAndDeleteFence(stagingFences[0]);
+	WaitAndDeleteFence(stagingFences[1]);
+}
+
+void ReleaseStagingBuffer()
+{
+	if (!stagingBuffer)
+		return;
+	FinishUploads();
+	DeleteRegisteredBuffer("staging_buffer");
+	stagingBuffer = 0;
+	stagingMapped = nullptr;
+}
+
+
+
+void CreateBuffer(const char* const name, int binding, GLsizeiptr datasize, const void* data)
+{
+	CreateRegisteredBuffer(name, GL_SHADER_STORAGE_BUFFER, binding, datasize, data, GL_STATIC_DRAW);
 
 	int block_index = glGetProgramResourceIndex(rayTraceProgram, GL_SHADER_STORAGE_BLOCK, name);
 	glShaderStorageBlockBinding(rayTraceProgram, block_index, binding);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
 }
 
-void CreateBufferAndCount(const char* const name, int binding, int numelements, int datasize, void* data)
+void CreateBufferAndCount(const char* const name, int binding, int numelements, GLsizeiptr datasize, const void* data)
 {
-	GLuint buffer;
-	glGenBuffers(1, &buffer);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, datasize + 16, NULL, GL_STATIC_DRAW);
+	double startTime = glfwGetTime();
 
-	void* ptr = glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_WRITE_ONLY);
-	// now copy data into memory
-	memcpy(ptr, &numelements, sizeof(int));
-	memcpy((void*)((size_t)ptr + 16), data, datasize);
-	// make sure to tell OpenGL we're done with the pointer
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	// The count takes the first 16 bytes so the array after it stays aligned
+	GLuint buffer = CreateRegisteredBuffer(name, GL_SHADER_STORAGE_BUFFER, binding, datasize + 16, NULL, GL_STATIC_DRAW);
+	int header[4] = { numelements, 0, 0, 0 };
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(header), header);
+	// The copies run on while the next buffer is prepared, ReleaseStagingBuffer() waits for them
+	UploadBufferData(buffer, 16, datasize, data);
+
+	double time = glfwGetTime() - startTime;
+	double megabytes = (double)(datasize + 16) / (1024.0 * 1024.0);
+	std::cout << "Queued " << name << ": " << megabytes << " MB in " << time * 1000.0 << "ms\n";
 
 	int block_index = glGetProgramResourceIndex(rayTraceProgram, GL_SHADER_STORAGE_BLOCK, name);
 	glShaderStorageBlockBinding(rayTraceProgram, block_index, binding);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+}
+
+
+
+static int dynamicRegion = 0;
+static GLsync dynamicFences[DynamicBuffer::regionCount] = {};
+
+DynamicBuffer::DynamicBuffer() :
+	m_target{ GL_SHADER_STORAGE_BUFFER },
+	m_binding{ 0 },
+	m_buffer{ 0 },
+	m_size{ 0 },
+	m_regionStride{ 0 },
+	m_mapped{ nullptr }
+{}
+
+DynamicBuffer::DynamicBuffer(const char* name, GLenum target, GLuint binding, GLsizeiptr size) :
+	m_target{ target },
+	m_binding{ binding },
+	m_size{ size }
+{
+	GLint alignment = 1;
+	glGetIntegerv(target == GL_UNIFORM_BUFFER ? GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT : GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	m_regionStride = (size + alignment - 1) / alignment * alignment;
+
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glGenBuffers(1, &m_buffer);
+	glBindBuffer(target, m_buffer);
+	glBufferStorage(target, m_regionStride * regionCount, NULL, flags);
+	m_mapped = (char*)glMapBufferRange(target, 0, m_regionStride * regionCount, flags);
+	TrackBuffer(name, { target, binding, m_buffer, m_regionStride * regionCount, 0 });
+}
 
+void* DynamicBuffer::Map()
+{
+	glBindBufferRange(m_target, m_binding, m_buffer, m_regionStride * dynamicRegion, m_size);
+	return m_mapped + m_regionStride * dynamicRegion;
+}
+
+void BeginDynamicFrame()
+{
+	dynamicRegion = (dynamicRegion + 1) % DynamicBuffer::regionCount;
+	WaitAndDeleteFence(dynamicFences[dynamicRegion]);
+}
+
+void EndDynamicFrame()
+{
+	dynamicFences[dynamicRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+
+
+// Bounds and packed references of all analytic primitives, collected by the
+// Init*Data() functions and built into one bvh by InitPrimitiveBuffers()
+static std::vector<BoundingBox> primitiveBounds;
+static std::vector<int> primitiveRefs;
+
+static void AddPrimitive(PrimitiveType type, int index, glm::vec3 boundsMin, glm::vec3 boundsMax)
+{
+	BoundingBox bounds{};
+	bounds.GrowToInclude(boundsMin, boundsMax);
+	primitiveBounds.push_back(bounds);
+	primitiveRefs.push_back((type << 24) | index);
+}
+
+
+
+static std::vector<Ring> rings;
+
+void InitMaterialData()
+{
+	// In the order of SceneMaterial, layer 0 of materialTextures is grass.png
+	std::vector<Material> materials = {
+		{ glm::vec4(1, 1, 1, 0), glm::mat4(1.0f), -1, 0.0f, PROJECTION_NONE, 0 },
+		{ glm::vec4(1, 1, 1, 0.1f), glm::mat4(1.0f), 0, 0.2f, PROJECTION_NONE, 0 },
+		{ glm::vec4(0.45f, 0.4f, 0.35f, 0), glm::mat4(1.0f), -1, 0.0f, PROJECTION_NONE, 0 },
+	};
+	// The mesh grass continues the texture of the ring floor it lies on
+	if (!rings.empty())
+	{
+		materials[MATERIAL_GRASS].worldToTextureMatrix = rings[0].worldToLocalMatrix;
+		materials[MATERIAL_GRASS].projection = PROJECTION_CYLINDER;
+	}
+
+	// A uniform block, the wavefront kernels have no storage block left for it
+	materials.resize(Material::maxCount);
+	CreateRegisteredBuffer("material_data", GL_UNIFORM_BUFFER, 1, sizeof(Material) * materials.size(), materials.data(), GL_STATIC_DRAW);
 }
 
 
 
 void InitSphereData()
 {
-	Sphere spheres[100] = { 0 };
+	std::vector<Sphere> spheres(100);
 
-	for (int i = 0; i < 100; i++)
+	for (int i = 0; i < spheres.size(); i++)
 	{
 		spheres[i] = {
 			RandomRange(-40, 40),
@@ -59,16 +375,512 @@ void InitSphereData()
 			RandomRange(0.5f, 1.0f),
 			1
 		};
+
+		glm::vec3 position = glm::vec3(spheres[i].position_x, spheres[i].position_y, spheres[i].position_z);
+		AddPrimitive(PRIMITIVE_SPHERE, i, position - spheres[i].radius, position + spheres[i].radius);
+	}
+
+	CreateBufferAndCount("sphere_buffer", 4, spheres.size(), sizeof(Sphere) * spheres.size(), spheres.data());
+}
+
+
+
+float RayRingDist(const Ring& ring, glm::vec3 origin, glm::vec3 dir)
+{
+	glm::vec3 pos = glm::vec3(glm::vec4(origin, 1.0f) * ring.worldToLocalMatrix);
+	glm::vec3 localDir = glm::vec3(glm::vec4(dir, 0.0f) * ring.worldToLocalMatrix);
+	float halfWidth = ring.width / 2.0f;
+	float closest = INFINITY;
+
+	// Floor, the cylinder x^2 + y^2 = r^2 between the walls
+	float a = glm::dot(glm::vec2(localDir), glm::vec2(localDir));
+	float b = glm::dot(glm::vec2(pos), glm::vec2(localDir));
+	float c = glm::dot(glm::vec2(pos), glm::vec2(pos)) - ring.innerRadius * ring.innerRadius;
+	float discriminant = b * b - a * c;
+	if (a > 0 && discriminant >= 0)
+	{
+		// Without the cancellation of -b + sqrt, rays leaving the floor start close to a root
+		float q = -(b + std::copysign(std::sqrt(discriminant), b));
+		float roots[2] = { q / a, c / q };
+		for (float t : roots)
+		{
+			if (t > 0 && t < closest && std::abs(pos.z + localDir.z * t) <= halfWidth)
+				closest = t;
+		}
 	}
 
-	CreateBufferAndCount("sphere_buffer", 4, 20, sizeof(spheres), &spheres);
+	// Walls, the annuli in the planes at both edges of the floor
+	float wallTop = ring.innerRadius - ring.wallHeight;
+	for (int side = -1; side <= 1; side += 2)
+	{
+		float t = (side * halfWidth - pos.z) / localDir.z;
+		glm::vec2 hit = glm::vec2(pos) + glm::vec2(localDir) * t;
+		float radiusSquared = glm::dot(hit, hit);
+		if (t > 0 && t < closest && radiusSquared <= ring.innerRadius * ring.innerRadius && radiusSquared >= wallTop * wallTop)
+			closest = t;
+	}
+	return closest;
 }
 
+void InitRingData()
+{
+	// The base of ringworld2.OBJ_MODEL, the terrain lies on its floor
+	Ring ring{};
+	ring.worldToLocalMatrix = CreateWorldToLocalMatrix(glm::vec3(0), glm::vec3(0), glm::vec3(1));
+	ring.localToWorldMatrix = glm::inverse(ring.worldToLocalMatrix);
+	ring.innerRadius = 3037.0f;
+	ring.width = 270.0f;
+	ring.wallHeight = 100.0f;
+	ring.floorMaterial = MATERIAL_GRASS;
+	ring.albedoSpecular = glm::vec4(1, 1, 1, 0);
+	rings.push_back(ring);
 
+	for (int i = 0; i < rings.size(); i++)
+	{
+		// World bounds of the local box around the band
+		float radius = rings[i].innerRadius;
+		float halfWidth = rings[i].width / 2.0f;
+		BoundingBox bounds{};
+		for (int corner = 0; corner < 8; corner++)
+		{
+			glm::vec4 local = glm::vec4(
+				corner & 1 ? radius : -radius,
+				corner & 2 ? radius : -radius,
+				corner & 4 ? halfWidth : -halfWidth,
+				1.0f);
+			glm::vec3 world = glm::vec3(local * rings[i].localToWorldMatrix);
+			bounds.GrowToInclude(world, world);
+		}
+		AddPrimitive(PRIMITIVE_RING, i, bounds.min, bounds.max);
+	}
+
+	CreateBufferAndCount("ring_buffer", 17, rings.size(), sizeof(Ring) * rings.size(), rings.data());
+}
 
-void InitModelBuffers()
+float RayRingsDist(glm::vec3 origin, glm::vec3 dir)
 {
-	BuildAndDoEverythingElseWithBVH();
+	float closest = INFINITY;
+	for (const Ring& ring : rings)
+		closest = std::min(closest, RayRingDist(ring, origin, dir));
+	return closest;
+}
+
+
+
+static void AddCapsule(std::vector<Capsule>& capsules, glm::vec3 positionA, glm::vec3 positionB, float radius, glm::vec4 albedoSpecular)
+{
+	capsules.push_back({
+		positionA.x, positionA.y, positionA.z, 0,
+		positionB.x, positionB.y, positionB.z,
+		radius,
+		albedoSpecular.r, albedoSpecular.g, albedoSpecular.b, albedoSpecular.a
+	});
+	AddPrimitive(PRIMITIVE_CAPSULE, capsules.size() - 1, glm::min(positionA, positionB) - radius, glm::max(positionA, positionB) + radius);
+}
+
+void InitCapsuleData()
+{
+	std::vector<Capsule> capsules;
+
+	for (int i = 0; i < 20; i++)
+	{
+		glm::vec3 center = glm::vec3(RandomRange(-40, 40), RandomRange(-40, 40) - 2900, RandomRange(-40, 40));
+		glm::vec3 direction = glm::normalize(glm::vec3(RandomRange(-1, 1), RandomRange(-1, 1), RandomRange(-1, 1)));
+		glm::vec3 halfLength = direction * RandomRange(5.0f, 15.0f);
+		glm::vec4 albedoSpecular = glm::vec4(RandomRange(0.5f, 1.0f), RandomRange(0.5f, 1.0f), RandomRange(0.5f, 1.0f), 0);
+		AddCapsule(capsules, center - halfLength, center + halfLength, RandomRange(0.2f, 1.0f), albedoSpecular);
+	}
+
+	// Straight across the band from the top of one wall to the other
+	const int cableCount = 36;
+	const Ring& ring = rings[0];
+	float wallTop = ring.innerRadius - ring.wallHeight;
+	for (int i = 0; i < cableCount; i++)
+	{
+		float angle = i * glm::radians(360.0f) / cableCount;
+		glm::vec3 position = glm::vec3(std::cos(angle), std::sin(angle), 0) * wallTop;
+		glm::vec4 positionA = glm::vec4(position.x, position.y, -ring.width / 2.0f, 1.0f) * ring.localToWorldMatrix;
+		glm::vec4 positionB = glm::vec4(position.x, position.y, ring.width / 2.0f, 1.0f) * ring.localToWorldMatrix;
+		AddCapsule(capsules, glm::vec3(positionA), glm::vec3(positionB), 2.0f, glm::vec4(0.3f, 0.3f, 0.3f, 0));
+	}
+
+	CreateBufferAndCount("capsule_buffer", 20, capsules.size(), sizeof(Capsule) * capsules.size(), capsules.data());
+}
+
+
+
+// Kept for RayTerrainsDist(), the tile of each instance and its worldToLocalMatrix
+static std::vector<TerrainTile> terrainTiles;
+static std::vector<std::pair<int, glm::mat4>> terrainInstances;
+
+void InitTerrainData()
+{
+	std::vector<TerrainTile>& tiles = terrainTiles;
+	tiles.clear();
+	terrainInstances.clear();
+
+	// The first tile from heightmap.png over the same area as the generated ones
+	int heightmapSize = 0;
+	std::vector<float> heightmap = LoadHeightmap("heightmap.png", 500.0f, &heightmapSize);
+	if (!heightmap.empty())
+		tiles.push_back(CreateTerrainTile(heightmap, heightmapSize, 256.0f / heightmapSize));
+	else
+		std::cout << "Could not load heightmap.png, generating the terrain instead" << std::endl;
+	for (unsigned int seed = tiles.size(); seed < 3; seed++)
+		tiles.push_back(CreateTerrainTile(GenerateHeightmap(64, 500.0f, seed * 7919), 64, 4.0f));
+
+	// Every tile stores its triangles and then its mips
+	std::vector<unsigned int> terrainData;
+	std::vector<int> triangleOffsets;
+	for (int i = 0; i < tiles.size(); i++)
+	{
+		triangleOffsets.push_back(terrainData.size());
+		const unsigned int* triangles = (const unsigned int*)tiles[i].triangles.data();
+		terrainData.insert(terrainData.end(), triangles, triangles + tiles[i].triangles.size() * 8);
+		terrainData.insert(terrainData.end(), tiles[i].minMaxMips.begin(), tiles[i].minMaxMips.end());
+	}
+
+	// Evenly around the ring, offset by half a step so none lies under the camera
+	const int instanceCount = 12;
+	std::vector<TerrainInstance> instances;
+	for (int i = 0; i < instanceCount; i++)
+	{
+		const TerrainTile& tile = tiles[i % tiles.size()];
+		float angle = (i + 0.5f) * glm::radians(360.0f) / instanceCount;
+
+		TerrainInstance instance{};
+		instance.worldToLocalMatrix = PlaceTerrainOnRing(tile, rings[0], angle, 0.0f);
+		instance.localToWorldMatrix = glm::inverse(instance.worldToLocalMatrix);
+		instance.triangleOffset = triangleOffsets[i % tiles.size()];
+		instance.mipOffset = instance.triangleOffset + tile.triangles.size() * 8;
+		instance.cellCount = tile.cellCount;
+		instance.mipLevels = tile.MipLevels();
+		instance.cellSize = tile.cellSize;
+		instance.minHeight = tile.minHeight;
+		instance.heightScale = tile.HeightScale();
+		instance.cellSteps = tile.cellSteps;
+		instances.push_back(instance);
+		terrainInstances.push_back({ i % (int)tiles.size(), instance.worldToLocalMatrix });
+
+		float size = tile.cellCount * tile.cellSize;
+		BoundingBox bounds{};
+		for (int corner = 0; corner < 8; corner++)
+		{
+			glm::vec4 local = glm::vec4(
+				corner & 1 ? size : 0.0f,
+				corner & 2 ? size : 0.0f,
+				corner & 4 ? tile.maxHeight : tile.minHeight,
+				1.0f);
+			glm::vec3 world = glm::vec3(local * instance.localToWorldMatrix);
+			bounds.GrowToInclude(world, world);
+		}
+		AddPrimitive(PRIMITIVE_TERRAIN, i, bounds.min, bounds.max);
+	}
+
+	CreateBufferAndCount("terrain_instance_buffer", 18, instances.size(), sizeof(TerrainInstance) * instances.size(), instances.data());
+	CreateBufferAndCount("terrain_data_buffer", 19, terrainData.size(), sizeof(unsigned int) * terrainData.size(), terrainData.data());
+}
+
+float RayTerrainsDist(glm::vec3 origin, glm::vec3 dir, float maxDist)
+{
+	float closest = maxDist;
+	for (const std::pair<int, glm::mat4>& instance : terrainInstances)
+	{
+		// Rigid transform, distances are the same in local space
+		glm::vec3 localOrigin = glm::vec3(glm::vec4(origin, 1.0f) * instance.second);
+		glm::vec3 localDir = glm::vec3(glm::vec4(dir, 0.0f) * instance.second);
+		closest = std::min(closest, RayTerrainDist(terrainTiles[instance.first], localOrigin, localDir, closest));
+	}
+	return closest;
+}
+
+
+
+bool InitPrimitiveBuffers()
+{
+	BLAS primitiveBLAS{ primitiveBounds };
+	if (!primitiveBLAS.m_built)
+		return false;
+
+	// Reorder the references to match the leaves of the bvh
+	std::vector<int> orderedRefs;
+	orderedRefs.reserve(primitiveRefs.size());
+	for (int i = 0; i < primitiveBLAS.m_triangleIndices.size(); i++)
+		orderedRefs.push_back(primitiveRefs[primitiveBLAS.m_triangleIndices[i]]);
+
+	CreateBufferAndCount(
+		"primitive_buffer",
+		8,
+		orderedRefs.size(),
+		sizeof(int) * orderedRefs.size(),
+		(void*)orderedRefs.data());
+
+	CreateBufferAndCount(
+		"primitive_node_buffer",
+		9,
+		primitiveBLAS.m_nodes.nodes.size(),
+		sizeof(BLAS::Node) * primitiveBLAS.m_nodes.nodes.size(),
+		(void*)primitiveBLAS.m_nodes.nodes.data());
+
+	primitiveBLAS.ReleaseBuildData();
+	std::vector<BoundingBox>().swap(primitiveBounds);
+	std::vector<int>().swap(primitiveRefs);
+	return true;
+}
 
-	return;
+
+
+// Room for the count and count elements of elementSize bytes, 0 if that is more than a shader
+// storage block can hold. That is the ceiling of the whole scene, every blas shares the buffer.
+static GLuint ReserveGeometryBuffer(const char* name, GLuint binding, size_t elementSize, size_t count)
+{
+	GLint64 maxSize = 0;
+	glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxSize);
+	GLsizeiptr size = 16 + elementSize * count;
+	if (size > maxSize)
+	{
+		std::cout << "The scene needs " << count << " entries of " << name << " (" << size / (1024.0 * 1024.0) << " MB), a shader storage block holds at most "
+			<< (maxSize - 16) / elementSize << " (" << maxSize / (1024.0 * 1024.0) << " MB)!\n";
+		return 0;
+	}
+	if (!GetRegisteredBuffer(name))
+		return CreateRegisteredBuffer(name, GL_SHADER_STORAGE_BUFFER, binding, size, NULL, GL_STATIC_DRAW);
+	return ResizeRegisteredBuffer(name, size);
+}
+
+// Everything uploaded so far, each blas owns a range of triangle_buffer, node_buffer and reference_buffer
+static int uploadedTriangles = 0;
+static int uploadedNodes = 0;
+static int uploadedReferences = 0;
+std::vector<UploadedBLAS> uploadedBLASes;
+
+bool UploadModel(Model& model, const RayTraceModel& instance, std::vector<RayTraceModel>& models)
+{
+	double startTime = glfwGetTime();
+
+	// Meshes too big for one blas become several, each drawn as its own instance
+	std::vector<int> partSizes;
+	PartitionTriangles(model.triangles, 0, model.triangles.size(), BLAS::maxBLASTriangles, partSizes);
+
+	const size_t triangleSize = BLAS::uploadCompactData ? sizeof(TinyTriangle) : sizeof(Triangle);
+	GLuint triangleBuffer = ReserveGeometryBuffer("triangle_buffer", 6, triangleSize, (size_t)uploadedTriangles + model.triangles.size());
+	if (!triangleBuffer)
+		return false;
+	GLsizeiptr uploadedBytes = 0;
+	int partStart = 0;
+	for (int partSize : partSizes)
+	{
+		Model part{};
+		if (partSizes.size() == 1)
+			part.triangles.swap(model.triangles);
+		else
+			part.triangles.assign(model.triangles.begin() + partStart, model.triangles.begin() + partStart + partSize);
+		partStart += partSize;
+
+		BLAS blas{ part };
+		if (!blas.m_built)
+			return false;
+		// The blas has its own reordered copy of the triangles
+		std::vector<Triangle>().swap(part.triangles);
+		if (BLAS::optimizeTreelets)
+			blas.OptimizeTreelets();
+		blas.Reorder(BLAS::uploadLayout);
+
+		RayTraceModel partInstance = instance;
+		BLAS::CompactExtents(blas.m_bounds, &partInstance.boundsMin, &partInstance.boundsExtent);
+
+		std::vector<TinyTriangle> tinyTriangles;
+		const void* triangleData = blas.m_orderedTriangles.data();
+		if (BLAS::uploadCompactData)
+		{
+			tinyTriangles = BLAS::ToTinyTriangles(blas.m_orderedTriangles, partInstance.boundsMin, partInstance.boundsExtent);
+			triangleData = tinyTriangles.data();
+		}
+		GLsizeiptr triangleBytes = triangleSize * (GLsizeiptr)blas.m_triangleCount;
+		UploadBufferData(triangleBuffer, 16 + triangleSize * (GLsizeiptr)uploadedTriangles, triangleBytes, triangleData);
+
+		std::vector<BLAS::PairNode> pairs;
+		std::vector<BLAS::TinyNode> tinyNodes;
+		const void* nodeData = blas.m_nodes.nodes.data();
+		size_t nodeSize = sizeof(BLAS::Node);
+		int nodeCount = blas.m_nodeCount;
+		if (BLAS::uploadPairNodes)
+		{
+			pairs = BLAS::ToPairNodes(blas.m_nodes.nodes, blas.m_nodeLayout);
+			nodeData = pairs.data();
+			nodeSize = sizeof(BLAS::PairNode);
+			nodeCount = pairs.size();
+		}
+		else if (BLAS::uploadCompactData)
+		{
+			if (!BLAS::ToTinyNodes(blas.m_nodes.nodes, partInstance.boundsMin, partInstance.boundsExtent, &tinyNodes))
+			{
+				std::cout << "The blas of " << blas.m_triangleCount << " triangles has too many nodes or references for TinyNodes!\n";
+				return false;
+			}
+			nodeData = tinyNodes.data();
+			nodeSize = sizeof(BLAS::TinyNode);
+		}
+		GLuint nodeBuffer = ReserveGeometryBuffer("node_buffer", 7, nodeSize, (size_t)uploadedNodes + nodeCount);
+		if (!nodeBuffer)
+			return false;
+		GLsizeiptr nodeBytes = nodeSize * (GLsizeiptr)nodeCount;
+		UploadBufferData(nodeBuffer, 16 + nodeSize * (GLsizeiptr)uploadedNodes, nodeBytes, nodeData);
+		uploadedBytes += triangleBytes + nodeBytes;
+
+		int referenceCount = blas.m_references.size();
+		if (referenceCount > 0)
+		{
+			GLuint referenceBuffer = ReserveGeometryBuffer("reference_buffer", 16, sizeof(int), (size_t)uploadedReferences + referenceCount);
+			if (!referenceBuffer)
+				return false;
+			GLsizeiptr referenceBytes = sizeof(int) * (GLsizeiptr)referenceCount;
+			UploadBufferData(referenceBuffer, 16 + sizeof(int) * (GLsizeiptr)uploadedReferences, referenceBytes, blas.m_references.data());
+			uploadedBytes += referenceBytes;
+		}
+
+		partInstance.nodeOffset = uploadedNodes;
+		partInstance.triOffset = uploadedTriangles;
+		partInstance.referenceOffset = uploadedReferences;
+		models.push_back(partInstance);
+		uploadedBLASes.push_back({ uploadedNodes, nodeCount, uploadedTriangles, blas.m_triangleCount, uploadedReferences, referenceCount, instance.worldToLocalMatrix });
+
+		uploadedTriangles += blas.m_triangleCount;
+		uploadedNodes += nodeCount;
+		uploadedReferences += referenceCount;
+		blas.ReleaseBuildData();
+	}
+	std::vector<Triangle>().swap(model.triangles);
+
+	glNamedBufferSubData(GetRegisteredBuffer("triangle_buffer"), 0, sizeof(int), &uploadedTriangles);
+	glNamedBufferSubData(GetRegisteredBuffer("node_buffer"), 0, sizeof(int), &uploadedNodes);
+	if (GetRegisteredBuffer("reference_buffer"))
+		glNamedBufferSubData(GetRegisteredBuffer("reference_buffer"), 0, sizeof(int), &uploadedReferences);
+	FinishUploads();
+
+	double time = glfwGetTime() - startTime;
+	double megabytes = uploadedBytes / (1024.0 * 1024.0);
+	std::cout << "Uploaded model as " << partSizes.size() << " blas: " << megabytes << " MB in " << time * 1000.0 << "ms = " << megabytes / time << " MB/s\n";
+	return true;
+}
+
+// Drops the triangles with every vertex within tolerance of the floor or walls of the ring
+static void RemoveTrianglesOnRing(Model& model, const RayTraceModel& instance, const Ring& ring, float tolerance)
+{
+	glm::mat4 modelToRing = instance.localToWorldMatrix * ring.worldToLocalMatrix;
+	float halfWidth = ring.width / 2.0f;
+	float wallTop = ring.innerRadius - ring.wallHeight;
+	// 1 if the vertex is on the floor and 2 if it is on a wall, the edges of the floor are on both
+	auto surfacesOf = [&](glm::vec4 vertex)
+	{
+		glm::vec3 local = glm::vec3(glm::vec4(glm::vec3(vertex), 1.0f) * modelToRing);
+		float radius = glm::length(glm::vec2(local));
+		bool isOnFloor = std::abs(radius - ring.innerRadius) <= tolerance && std::abs(local.z) <= halfWidth + tolerance;
+		bool isOnWall = std::abs(std::abs(local.z) - halfWidth) <= tolerance &&
+			radius >= wallTop - tolerance && radius <= ring.innerRadius + tolerance;
+		return (isOnFloor ? 1 : 0) | (isOnWall ? 2 : 0);
+	};
+
+	size_t triangleCount = model.triangles.size();
+	auto removed = std::remove_if(model.triangles.begin(), model.triangles.end(), [&](const Triangle& tri)
+	{
+		// A triangle from the floor up to the top of a wall is not covered by the ring
+		return (surfacesOf(tri.vertA) & surfacesOf(tri.vertB) & surfacesOf(tri.vertC)) != 0;
+	});
+	model.triangles.erase(removed, model.triangles.end());
+	std::cout << "Ring replaces " << triangleCount - model.triangles.size() << " triangles\n";
+}
+
+// Grass on the triangles between the wall planes of the ring, the walls themselves keep their material
+static void AssignRingMaterials(Model& model, const RayTraceModel& instance, const Ring& ring)
+{
+	glm::mat4 modelToRing = instance.localToWorldMatrix * ring.worldToLocalMatrix;
+	float halfWidth = ring.width / 2.0f;
+	for (Triangle& tri : model.triangles)
+	{
+		glm::vec3 center = glm::vec3(glm::vec4(glm::vec3(tri.vertA + tri.vertB + tri.vertC) / 3.0f, 1.0f) * modelToRing);
+		if (std::abs(center.z) < halfWidth - 0.001f)
+			tri.vertA.w = MATERIAL_GRASS;
+	}
+}
+
+// The model file is read on its own thread, see StartLoadingModels()
+static std::future<Model> modelLoad;
+static double modelLoadTime = 0.0;
+
+void StartLoadingModels()
+{
+	modelLoad = std::async(std::launch::async, []()
+	{
+		double startTime = glfwGetTime();
+		Model model = LoadModel("ringworld2.OBJ_MODEL");
+		modelLoadTime = glfwGetTime() - startTime;
+		return model;
+	});
+}
+
+// The instances of the loaded models are returned in models, see UpdateModelBuffer().
+// Triangles lying on the surface of one of the rings are dropped, the ring replaces them.
+// False if a model could not be uploaded.
+static bool BuildAndDoEverythingElseWithBVH(std::vector<RayTraceModel>& modelsBuffer, const std::vector<Ring>& rings)
+{
+	if (!modelLoad.valid())
+		StartLoadingModels();
+	double waitStartTime = glfwGetTime();
+	Model testo = modelLoad.get();
+	double waitTime = glfwGetTime() - waitStartTime;
+	std::cout << "Read ringworld2.OBJ_MODEL in " << modelLoadTime * 1000.0 << "ms, waited " << waitTime * 1000.0 << "ms for it\n";
+	if (testo.triangles.empty())
+	{
+		std::cout << "Could not load ringworld2.OBJ_MODEL!\n";
+		return false;
+	}
+	RayTraceModel testoInstance(
+		glm::vec3(1.0f, 1.0f, 1.0f),
+		0.5f,
+		0,
+		glm::vec3(0, 0, 0),
+		glm::vec3(0, 0, 0),
+		glm::vec3(1, 1, 1));
+	// The mesh is not perfectly round, its band is up to half a unit off
+	for (const Ring& ring : rings)
+		RemoveTrianglesOnRing(testo, testoInstance, ring, 1.0f);
+	for (const Ring& ring : rings)
+		AssignRingMaterials(testo, testoInstance, ring);
+	modelsBuffer.clear();
+	if (!UploadModel(testo, testoInstance, modelsBuffer))
+		return false;
+	
+	//exit(0);
+
+	//CreateBuffer("node_buffer", 7, 0, 0);
+
+	//std::cout << "glGetError() = " << glGetError() << "\n";
+
+	return true;
+}
+
+
+
+// Doesn't change after InitModelBuffers()
+static std::vector<RayTraceModel> models;
+static DynamicBuffer modelBuffer;
+
+bool InitModelBuffers()
+{
+	if (!BuildAndDoEverythingElseWithBVH(models, rings))
+		return false;
+
+	// Same layout as CreateBufferAndCount(), the count then the models from offset 16
+	modelBuffer = DynamicBuffer("model_buffer", GL_SHADER_STORAGE_BUFFER, 5, 16 + sizeof(RayTraceModel) * models.size());
+	UpdateModelBuffer();
+	return true;
+}
+
+void UpdateModelBuffer()
+{
+	int modelCount = models.size();
+	char* data = (char*)modelBuffer.Map();
+	memcpy(data, &modelCount, sizeof(int));
+	memcpy(data + 16, models.data(), sizeof(RayTraceModel) * modelCount);
 }
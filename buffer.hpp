@@ -1,10 +1,64 @@
 #pragma once
 
+#include <vector>
+#include <glad/glad.h>
+#include <glm/glm.hpp>
 
+struct Model;
+struct RayTraceModel;
 
-void CreateBuffer(const char* const name, int binding, int datasize, void* data);
 
-void CreateBufferAndCount(const char* const name, int binding, int numelements, int datasize, void* data);
+
+// Named gpu buffers owned by the registry, creating one under an existing name frees the old one
+GLuint CreateRegisteredBuffer(const char* name, GLenum target, GLuint binding, GLsizeiptr size, const void* data, GLenum usage);
+// Grows the buffer to at least size bytes keeping its contents and rebinds it, the handle changes
+GLuint ResizeRegisteredBuffer(const char* name, GLsizeiptr size);
+GLuint GetRegisteredBuffer(const char* name);
+void DeleteRegisteredBuffer(const char* name);
+void DeleteAllRegisteredBuffers();
+// Textures are only tracked for the memory report, DeleteAllRegisteredBuffers() frees them too
+void RegisterTexture(const char* name, GLuint texture);
+void PrintGPUMemoryReport();
+
+// Copies size bytes into buffer at offset through the staging chunks, the copies
+// are only queued so call FinishUploads() before timing or freeing data
+void UploadBufferData(GLuint buffer, GLintptr offset, GLsizeiptr size, const void* data);
+void FinishUploads();
+// Frees the staging chunks once the scene is loaded
+void ReleaseStagingBuffer();
+
+void CreateBuffer(const char* const name, int binding, GLsizeiptr datasize, const void* data);
+
+void CreateBufferAndCount(const char* const name, int binding, int numelements, GLsizeiptr datasize, const void* data);
+
+
+
+// Persistently mapped buffer with one region per frame in flight, the cpu writes the
+// region of the current frame while the gpu may still be reading the older ones
+struct DynamicBuffer
+{
+	static const int regionCount = 3;
+
+	GLenum m_target;
+	GLuint m_binding;
+	GLuint m_buffer;
+	GLsizeiptr m_size;
+	GLsizeiptr m_regionStride; // m_size rounded up to the offset alignment of m_target
+	char* m_mapped;
+
+	DynamicBuffer();
+	// The buffer is owned by the registry under name
+	DynamicBuffer(const char* name, GLenum target, GLuint binding, GLsizeiptr size);
+
+	// Binds the region of the current frame and returns where to write it
+	void* Map();
+};
+
+// Moves every DynamicBuffer on to the next region, waiting for the gpu if it
+// has not finished the frame that last used that region
+void BeginDynamicFrame();
+// Call after the last command of the frame that reads the dynamic buffers
+void EndDynamicFrame();
 
 
 
@@ -20,6 +74,145 @@ struct Sphere
 	float albedoSpecular_specular;
 };
 
+// Cylinder between positionA and positionB with a hemisphere at both ends, for struts and cables
+struct Capsule
+{
+	float positionA_x;
+	float positionA_y;
+	float positionA_z;
+	float _padding0;
+	float positionB_x;
+	float positionB_y;
+	float positionB_z;
+	float radius;
+	float albedoSpecular_red;
+	float albedoSpecular_green;
+	float albedoSpecular_blue;
+	float albedoSpecular_specular;
+};
+
+// How the meshes, which have no texture coordinates, get them from the hit position in the
+// space of Material::worldToTextureMatrix
+enum MaterialProjection
+{
+	PROJECTION_NONE = 0, // Untextured
+	PROJECTION_CYLINDER = 1, // Axial distance and arc length around the z axis, like a Ring floor
+};
+
+// Entry of the material_data uniform block, indexed per triangle. The albedo is multiplied by the
+// texture layer.
+struct Material
+{
+	static const int maxCount = 128; // Size of the block, MAX_MATERIALS in comp_common.glsl
+
+	glm::vec4 albedoSpecular;
+	glm::mat4 worldToTextureMatrix;
+	int textureLayer; // In materialTextures, -1 for none
+	float textureScale; // Texture repeats per world unit
+	int projection; // MaterialProjection, only used for meshes
+	int _padding0;
+};
+
+// The materials created by InitMaterialData()
+enum SceneMaterial
+{
+	MATERIAL_WHITE = 0,
+	MATERIAL_GRASS = 1,
+	MATERIAL_ROCK = 2,
+};
+
+// Band around the local z axis seen from the inside, the base of the ringworld. The floor is
+// innerRadius from the axis and width wide, at both edges a wall rises wallHeight towards the axis.
+struct Ring
+{
+	glm::mat4 worldToLocalMatrix;
+	glm::mat4 localToWorldMatrix;
+	float innerRadius;
+	float width;
+	float wallHeight;
+	int floorMaterial;
+	glm::vec4 albedoSpecular; // Of the walls
+};
+
+// Placement of a TerrainTile, the tiles are packed into terrain_data_buffer and can be shared
+// between instances. The local space is the one of the tile, see terrain.hpp.
+struct TerrainInstance
+{
+	glm::mat4 worldToLocalMatrix;
+	glm::mat4 localToWorldMatrix;
+	int triangleOffset; // In uints of terrain_data_buffer
+	int mipOffset;
+	int cellCount;
+	int mipLevels;
+	float cellSize;
+	float minHeight;
+	float heightScale;
+	int cellSteps;
+};
+
+// Analytic primitives are referenced from the primitive bvh as (type << 24 | index)
+enum PrimitiveType
+{
+	PRIMITIVE_SPHERE = 0,
+	PRIMITIVE_RING = 1,
+	PRIMITIVE_TERRAIN = 2,
+	PRIMITIVE_CAPSULE = 3,
+};
+
+// Distance along dir to the closest hit of the ray with the ring, INFINITY if there is none.
+// Same test as ray_ring_intersection() in comp_common.glsl.
+float RayRingDist(const Ring& ring, glm::vec3 origin, glm::vec3 dir);
+
+// The layers of materialTextures are loaded by ProgramInit(). The grass is projected around the
+// first ring, call after InitRingData().
+void InitMaterialData();
+
 void InitSphereData();
 
-void InitModelBuffers();
+// Struts among the spheres and cables spanning the first ring, call after InitRingData()
+void InitCapsuleData();
+
+// The triangles of the models lying on the rings are left out, see InitModelBuffers()
+void InitRingData();
+// Closest hit of the ray with any of the rings of InitRingData(), INFINITY if there is none
+float RayRingsDist(glm::vec3 origin, glm::vec3 dir);
+
+// Mountain tiles placed on the floor of the first ring
+void InitTerrainData();
+// Distance along dir to the closest terrain hit, maxDist if there is none before it
+float RayTerrainsDist(glm::vec3 origin, glm::vec3 dir, float maxDist);
+
+// False if the primitive bvh could not be built
+bool InitPrimitiveBuffers();
+
+// Where UploadModel() put each blas in triangle_buffer, node_buffer and reference_buffer, the
+// node offset and count are in PairNodes if BLAS::uploadPairNodes is set
+struct UploadedBLAS
+{
+	int nodeOffset;
+	int nodeCount;
+	int triOffset;
+	int triCount;
+	int referenceOffset;
+	int referenceCount; // 0 if the leaves index the triangles directly
+	glm::mat4 worldToLocalMatrix;
+};
+extern std::vector<UploadedBLAS> uploadedBLASes;
+
+// Builds the model into blases of at most BLAS::maxBLASTriangles triangles, appends them to
+// triangle_buffer, node_buffer and reference_buffer and adds a copy of instance pointing at
+// each of them to models. The triangles of model are freed. False if it could not be uploaded.
+// All blases share those buffers because the kernels have no storage block binding left for more,
+// so the whole scene is capped at GL_MAX_SHADER_STORAGE_BLOCK_SIZE bytes of each. With 2 GB that
+// is about 22M triangles, or 67M with BLAS::uploadCompactData.
+bool UploadModel(Model& model, const RayTraceModel& instance, std::vector<RayTraceModel>& models);
+
+// Reads the model file on a thread so the rest of ProgramInit() overlaps the disk read,
+// InitModelBuffers() waits for it
+void StartLoadingModels();
+
+// False if the models could not be uploaded
+bool InitModelBuffers();
+
+// Writes the models into this frame's region of model_buffer
+void UpdateModelBuffer();
@@ -1,15 +1,19 @@
 #include "bvh.hpp"
 
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
 #include <string>
 #include <sstream>
 #include <strstream>
-
-#include "program.hpp"
-#include "utility.hpp"
-#include "buffer.hpp"
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <queue>
 
 
 
@@ -42,6 +46,51 @@ void BoundingBox::GrowToInclude(glm::vec3 min, glm::vec3 max)
 	}
 }
 
+bool ClipTriangle(const Triangle& tri, glm::vec3 boxMin, glm::vec3 boxMax, BoundingBox* out_bounds, float* out_area)
+{
+	// Each of the 6 planes adds at most one vertex
+	glm::vec3 polygon[9] = { glm::vec3(tri.vertA), glm::vec3(tri.vertB), glm::vec3(tri.vertC) };
+	glm::vec3 clipped[9];
+	int count = 3;
+	for (int plane = 0; plane < 6 && count > 0; plane++)
+	{
+		int axis = plane / 2;
+		bool isMax = plane % 2 == 1;
+		float bound = isMax ? boxMax[axis] : boxMin[axis];
+		auto inside = [&](glm::vec3 point) { return isMax ? point[axis] <= bound : point[axis] >= bound; };
+
+		int clippedCount = 0;
+		for (int i = 0; i < count; i++)
+		{
+			glm::vec3 a = polygon[i];
+			glm::vec3 b = polygon[(i + 1) % count];
+			if (inside(a))
+				clipped[clippedCount++] = a;
+			if (inside(a) != inside(b))
+				clipped[clippedCount++] = a + (b - a) * ((bound - a[axis]) / (b[axis] - a[axis]));
+		}
+		std::copy(clipped, clipped + clippedCount, polygon);
+		count = clippedCount;
+	}
+	if (count < 3)
+		return false;
+
+	BoundingBox bounds{};
+	glm::vec3 areaVector{ 0 };
+	for (int i = 0; i < count; i++)
+	{
+		bounds.GrowToInclude(polygon[i], polygon[i]);
+		if (i >= 1 && i + 1 < count)
+			areaVector += glm::cross(polygon[i] - polygon[0], polygon[i + 1] - polygon[0]);
+	}
+	// The intersection points can land a rounding error outside the box
+	bounds.min = glm::clamp(bounds.min, boxMin, boxMax);
+	bounds.max = glm::clamp(bounds.max, boxMin, boxMax);
+	*out_bounds = bounds;
+	*out_area = glm::length(areaVector) * 0.5f;
+	return true;
+}
+
 
 
 BLAS::Node::Node(BoundingBox bounds)
@@ -50,6 +99,8 @@ BLAS::Node::Node(BoundingBox bounds)
 	boundsMax = bounds.max;
 	startIndex = 0;
 	triangleCount = 0;
+	splitAxis = 0;
+	_padding3 = 0;
 }
 
 BLAS::Node::Node(BoundingBox bounds, int _startIndex, int _triangleCount)
@@ -58,14 +109,16 @@ BLAS::Node::Node(BoundingBox bounds, int _startIndex, int _triangleCount)
 	boundsMax = bounds.max;
 	startIndex = _startIndex;
 	triangleCount = _triangleCount;
+	splitAxis = 0;
+	_padding3 = 0;
 }
 
-glm::vec3 BLAS::Node::CalculateBoundsSize()
+glm::vec3 BLAS::Node::CalculateBoundsSize() const
 {
 	return boundsMax - boundsMin;
 }
 
-glm::vec3 BLAS::Node::CalculateBoundsCentre()
+glm::vec3 BLAS::Node::CalculateBoundsCentre() const
 {
 	return (boundsMin + boundsMax) / 2.0f;
 }
@@ -81,13 +134,35 @@ int BLAS::NodeList::Add(Node node)
 
 
 
-BLAS::BLAS(const Model& model, int maxNodeDepth)
+// In milliseconds, glfwGetTime() needs glfw to be initialized and the bvh code is also
+// used by the analyzer
+static double TimeMs()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+
+
+const int BLAS::traversalStackSize;
+const int BLAS::maxTreeDepth;
+const int BLAS::maxLeafTriangles;
+const int BLAS::maxBLASTriangles;
+bool BLAS::optimizeTreelets = true;
+float BLAS::presplitBudget = 0.3f;
+const int BLAS::splitAreaRatio;
+
+BLAS::BLAS(const Model& model, int maxNodeDepth, int minLeafSize, int maxLeafSize, float splitBudget)
 {
 	std::cout << "Creating BLAS\n";
 
-	m_maxNodeDepth = maxNodeDepth;
+	m_maxNodeDepth = std::min(maxNodeDepth, maxTreeDepth);
+	m_minLeafSize = minLeafSize;
+	m_maxLeafSize = std::max(maxLeafSize, minLeafSize);
+	m_nodeLayout = NodeLayout::Build;
 	m_bounds = {};
 	m_nodes = {};
+	double startTime = TimeMs();
 	m_bvhtriangles.reserve(model.triangles.size());
 	for (int i = 0; i < model.triangles.size(); i++)
 	{
@@ -95,108 +170,986 @@ BLAS::BLAS(const Model& model, int maxNodeDepth)
 		glm::vec3 boundsMin = glm::min(glm::min(tri.vertA, tri.vertB), tri.vertC);
 		glm::vec3 boundsMax = glm::max(glm::max(tri.vertA, tri.vertB), tri.vertC);
 		glm::vec3 center = (tri.vertA + tri.vertB + tri.vertC) / 3.0f;
-		m_bvhtriangles.push_back(BVHTriangle(boundsMin, boundsMax, center, i));
+		m_bvhtriangles.push_back(BVHTriangle(boundsMin, boundsMax, center));
 		m_bounds.GrowToInclude(boundsMin, boundsMax);
 	}
+	m_buildTimes.bounds = TimeMs() - startTime;
 
-	m_nodes.Add(Node(m_bounds));
-	Split(0, model.triangles, 0, m_bvhtriangles.size());
+	if (splitBudget > 0)
+	{
+		startTime = TimeMs();
+		int triangleCount = model.triangles.size();
+		double maxReferences = std::min(triangleCount * (1.0 + splitBudget), (double)maxBLASTriangles);
+		SplitReferences(model, std::max((int)maxReferences, triangleCount));
+		m_buildTimes.presplit = TimeMs() - startTime;
+	}
 
-	for (int i = 0; i < m_bvhtriangles.size(); i++)
+	startTime = TimeMs();
+	m_built = Build();
+	m_buildTimes.build = TimeMs() - startTime;
+	if (!m_built)
+		return;
+
+	// Single gather into leaf order
+	startTime = TimeMs();
+	if (m_referenceTriangles.empty())
+	{
+		m_orderedTriangles.resize(m_triangleIndices.size());
+		for (int i = 0; i < m_triangleIndices.size(); i++)
+			m_orderedTriangles[i] = model.triangles[m_triangleIndices[i]];
+	}
+	else
 	{
-		BVHTriangle bvhtri = m_bvhtriangles[i];
-		Triangle tri = model.triangles[bvhtri.index];
-		m_orderedTriangles.push_back(tri);
+		// Split triangles are stored at the first leaf that references them
+		std::vector<int> orderedIndex(model.triangles.size(), -1);
+		m_orderedTriangles.reserve(model.triangles.size());
+		m_references.resize(m_triangleIndices.size());
+		for (int i = 0; i < m_triangleIndices.size(); i++)
+		{
+			int triangle = m_referenceTriangles[m_triangleIndices[i]];
+			if (orderedIndex[triangle] < 0)
+			{
+				orderedIndex[triangle] = m_orderedTriangles.size();
+				m_orderedTriangles.push_back(model.triangles[triangle]);
+			}
+			m_references[i] = orderedIndex[triangle];
+		}
+		m_triangleCount = m_orderedTriangles.size();
+		std::cout << "References = " << m_referenceCount << " for " << m_triangleCount << " triangles\n";
 	}
+	m_buildTimes.gather = TimeMs() - startTime;
 
+	std::cout << "BLAS Done!\n";
+}
 
+BLAS::BLAS(const std::vector<BoundingBox>& primitiveBounds, int maxNodeDepth, int minLeafSize, int maxLeafSize)
+{
+	std::cout << "Creating primitive BLAS\n";
 
-	int startIndexMax = 0;
-	int triangleCountMax = 0;
-	for (int i = 0; i < m_nodes.nodes.size(); i++)
+	m_maxNodeDepth = std::min(maxNodeDepth, maxTreeDepth);
+	m_minLeafSize = minLeafSize;
+	m_maxLeafSize = std::max(maxLeafSize, minLeafSize);
+	m_nodeLayout = NodeLayout::Build;
+	m_bounds = {};
+	m_nodes = {};
+	double startTime = TimeMs();
+	m_bvhtriangles.reserve(primitiveBounds.size());
+	for (int i = 0; i < primitiveBounds.size(); i++)
 	{
-		BLAS::Node node = m_nodes.nodes[i];
-		if (node.startIndex > startIndexMax) startIndexMax = node.startIndex;
-		if (node.triangleCount > triangleCountMax) triangleCountMax = node.triangleCount;
+		const BoundingBox& bounds = primitiveBounds[i];
+		m_bvhtriangles.push_back(BVHTriangle(bounds.min, bounds.max, bounds.Center()));
+		m_bounds.GrowToInclude(bounds.min, bounds.max);
 	}
-	std::cout << "startIndexMax = " << startIndexMax << "\n";
-	std::cout << "triangleCountMax = " << triangleCountMax << "\n";
+	m_buildTimes.bounds = TimeMs() - startTime;
+
+	startTime = TimeMs();
+	m_built = Build();
+	m_buildTimes.build = TimeMs() - startTime;
+	if (!m_built)
+		return;
+
+	std::cout << "BLAS Done!\n";
+}
+
+void BLAS::ReleaseBuildData()
+{
+	// clear() keeps the capacity, swapping with an empty vector actually frees it
+	std::vector<BVHTriangle>().swap(m_bvhtriangles);
+	std::vector<int>().swap(m_referenceTriangles);
+	std::vector<int>().swap(m_triangleIndices);
+	std::vector<Triangle>().swap(m_orderedTriangles);
+	std::vector<int>().swap(m_references);
+	std::vector<Node>().swap(m_nodes.nodes);
+}
+
+void BLAS::Reorder(NodeLayout layout)
+{
+	double startTime = TimeMs();
+	ReorderNodes(m_nodes.nodes, m_nodeLayout, layout);
+	m_nodeLayout = layout;
+	m_buildTimes.reorder = TimeMs() - startTime;
+}
 
-	if (startIndexMax > (1 << 24) || triangleCountMax > (1 << 8))
+void BLAS::GetChildren(const std::vector<Node>& nodes, int index, NodeLayout layout, int* out_left, int* out_right)
+{
+	const Node& node = nodes[index];
+	if (layout == NodeLayout::LeftChildImplicit)
+	{
+		*out_left = index + 1;
+		*out_right = node.startIndex;
+	}
+	else
 	{
-		std::cerr << "CRITICAL ERROR TOO BIG MODEL!!!\n";
-		exit(-1);
+		*out_left = node.startIndex;
+		*out_right = node.startIndex + 1;
 	}
+}
 
-	std::cout << "BLAS Done!\n";
+static float SurfaceArea(const BLAS::Node& node)
+{
+	glm::vec3 size = node.CalculateBoundsSize();
+	return size.x * size.y + size.y * size.z + size.z * size.x;
 }
 
-void BLAS::Split(
-	int parentIndex,
-	const std::vector<Triangle>& triangles,
-	int triGlobalStart,
-	int triNum,
-	int depth)
+void BLAS::ReorderNodes(std::vector<Node>& nodes, NodeLayout from, NodeLayout to)
 {
-	Node parent = m_nodes.nodes[parentIndex];
-	glm::vec3 size = parent.CalculateBoundsSize();
-	float parentCost = NodeCost(size, triNum);
+	if (nodes.empty() || from == to)
+		return;
 
-	int splitAxis = 0;
-	float splitPos = 0;
-	float cost = 0;
-	ChooseSplit(&splitAxis, &splitPos, &cost, parent, triGlobalStart, triNum);
+	// order[new index] = old index, the root is always placed first
+	std::vector<int> order;
+	order.reserve(nodes.size());
+	order.push_back(0);
+	auto placeChildren = [&](int index)
+	{
+		int left, right;
+		GetChildren(nodes, index, from, &left, &right);
+		order.push_back(left);
+		order.push_back(right);
+	};
+	auto isParent = [&](int index) { return nodes[index].triangleCount <= 0; };
+
+	switch (to)
+	{
+	// The builder places sibling pairs in depth first order
+	case NodeLayout::Build:
+	case NodeLayout::DepthFirst:
+	{
+		std::vector<int> stack{ 0 };
+		while (!stack.empty())
+		{
+			int index = stack.back();
+			stack.pop_back();
+			if (!isParent(index))
+				continue;
+			placeChildren(index);
+			stack.push_back(order[order.size() - 1]);
+			stack.push_back(order[order.size() - 2]);
+		}
+		break;
+	}
+	case NodeLayout::BreadthFirst:
+	{
+		for (int i = 0; i < order.size(); i++)
+		{
+			if (isParent(order[i]))
+				placeChildren(order[i]);
+		}
+		break;
+	}
+	case NodeLayout::LeftChildImplicit:
+	{
+		order.clear();
+		std::vector<int> stack{ 0 };
+		while (!stack.empty())
+		{
+			int index = stack.back();
+			stack.pop_back();
+			order.push_back(index);
+			if (!isParent(index))
+				continue;
+			int left, right;
+			GetChildren(nodes, index, from, &left, &right);
+			stack.push_back(right);
+			stack.push_back(left);
+		}
+		break;
+	}
+	case NodeLayout::Treelet:
+	{
+		// Each treelet grows from its root by always expanding the node with the biggest
+		// surface area, the one most rays are likely to visit. Whatever is left on its
+		// frontier becomes the roots of the following treelets.
+		std::vector<int> treeletRoots{ 0 };
+		std::vector<int> frontier;
+		while (!treeletRoots.empty())
+		{
+			int root = treeletRoots.back();
+			treeletRoots.pop_back();
+			if (!isParent(root))
+				continue;
 
-	if (cost < parentCost && depth < m_maxNodeDepth)
+			frontier.assign(1, root);
+			for (int placed = 0; !frontier.empty() && placed + 2 <= treeletSize; placed += 2)
+			{
+				auto biggest = std::max_element(frontier.begin(), frontier.end(),
+					[&](int a, int b) { return SurfaceArea(nodes[a]) < SurfaceArea(nodes[b]); });
+				int index = *biggest;
+				frontier.erase(biggest);
+				placeChildren(index);
+				for (int child = (int)order.size() - 2; child < order.size(); child++)
+				{
+					if (isParent(order[child]))
+						frontier.push_back(order[child]);
+				}
+			}
+			// Reversed so the first frontier node is the next treelet, keeping it close by
+			treeletRoots.insert(treeletRoots.end(), frontier.rbegin(), frontier.rend());
+		}
+		break;
+	}
+	}
+
+	std::vector<int> newIndex(nodes.size());
+	for (int i = 0; i < order.size(); i++)
+		newIndex[order[i]] = i;
+
+	std::vector<Node> reordered;
+	reordered.reserve(nodes.size());
+	for (int i = 0; i < order.size(); i++)
+	{
+		Node node = nodes[order[i]];
+		if (node.triangleCount <= 0)
+		{
+			int left, right;
+			GetChildren(nodes, order[i], from, &left, &right);
+			node.startIndex = to == NodeLayout::LeftChildImplicit ? newIndex[right] : newIndex[left];
+		}
+		reordered.push_back(node);
+	}
+	nodes.swap(reordered);
+}
+
+// Cost of visiting a node relative to one triangle test, the build sah leaves it out
+static const float nodeTraversalCost = 1.0f;
+static const int treeletLeafCount = 7;
+
+static float HalfArea(glm::vec3 min, glm::vec3 max)
+{
+	glm::vec3 size = max - min;
+	return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+// Works on a copy of the tree with explicit children so the treelets can be rewired in place
+class TreeletOptimizer
+{
+public:
+	TreeletOptimizer(const std::vector<BLAS::Node>& nodes, BLAS::NodeLayout layout);
+
+	void Optimize(int passes);
+	float SAHCost() const;
+	std::vector<BLAS::Node> GetNodes() const;
+
+private:
+	struct Treelet
+	{
+		int leaves[treeletLeafCount];
+		int internals[treeletLeafCount - 1];
+		int partition[1 << treeletLeafCount];
+	};
+
+	std::vector<BLAS::Node> m_nodes;
+	std::vector<int> m_left; // -1 for leaves
+	std::vector<int> m_right;
+	std::vector<float> m_cost;
+	std::vector<int> m_height; // Of the subtree, 0 for leaves
+	std::vector<int> m_depth; // Below the root, updated once per pass
+
+	bool IsLeaf(int index) const { return m_left[index] < 0; }
+	float Area(int index) const { return HalfArea(m_nodes[index].boundsMin, m_nodes[index].boundsMax); }
+	void UpdateNode(int index);
+	// Parents after their children, the subtrees of nodes marked in skip are left out
+	std::vector<int> PostOrder(int root, const std::vector<char>& skip) const;
+	bool OptimizeTreelet(int root);
+	int Rebuild(const Treelet& treelet, int subset, int& nextInternal);
+};
+
+TreeletOptimizer::TreeletOptimizer(const std::vector<BLAS::Node>& nodes, BLAS::NodeLayout layout) :
+	m_nodes{ nodes },
+	m_left(nodes.size(), -1),
+	m_right(nodes.size(), -1),
+	m_cost(nodes.size(), 0.0f),
+	m_height(nodes.size(), 0),
+	m_depth(nodes.size(), 0)
+{
+	for (int i = 0; i < nodes.size(); i++)
 	{
-		BoundingBox boundsLeft{};
-		BoundingBox boundsRight{};
-		int numOnLeft = 0;
+		if (nodes[i].triangleCount <= 0)
+			BLAS::GetChildren(nodes, i, layout, &m_left[i], &m_right[i]);
+		else
+			m_cost[i] = Area(i) * nodes[i].triangleCount;
+	}
+	for (int index : PostOrder(0, std::vector<char>(nodes.size(), 0)))
+		UpdateNode(index);
+}
+
+void TreeletOptimizer::UpdateNode(int index)
+{
+	int left = m_left[index];
+	int right = m_right[index];
+	BLAS::Node& node = m_nodes[index];
+	node.boundsMin = glm::min(m_nodes[left].boundsMin, m_nodes[right].boundsMin);
+	node.boundsMax = glm::max(m_nodes[left].boundsMax, m_nodes[right].boundsMax);
+	m_cost[index] = nodeTraversalCost * Area(index) + m_cost[left] + m_cost[right];
+	m_height[index] = 1 + std::max(m_height[left], m_height[right]);
+}
+
+std::vector<int> TreeletOptimizer::PostOrder(int root, const std::vector<char>& skip) const
+{
+	// Reversed pre order, every parent is pushed before its children
+	std::vector<int> order;
+	std::vector<int> stack{ root };
+	while (!stack.empty())
+	{
+		int index = stack.back();
+		stack.pop_back();
+		if (IsLeaf(index) || skip[index])
+			continue;
+		order.push_back(index);
+		stack.push_back(m_left[index]);
+		stack.push_back(m_right[index]);
+	}
+	std::reverse(order.begin(), order.end());
+	return order;
+}
+
+float TreeletOptimizer::SAHCost() const
+{
+	return m_cost[0] / std::max(Area(0), 1e-20f);
+}
+
+void TreeletOptimizer::Optimize(int passes)
+{
+	if (IsLeaf(0))
+		return;
+
+	int threadCount = std::max(1u, std::thread::hardware_concurrency());
+	for (int pass = 0; pass < passes; pass++)
+	{
+		std::vector<int> stack{ 0 };
+		while (!stack.empty())
+		{
+			int index = stack.back();
+			stack.pop_back();
+			if (IsLeaf(index))
+				continue;
+			m_depth[m_left[index]] = m_depth[index] + 1;
+			m_depth[m_right[index]] = m_depth[index] + 1;
+			stack.push_back(m_left[index]);
+			stack.push_back(m_right[index]);
+		}
 
-		for (int i = triGlobalStart; i < triGlobalStart + triNum; i++)
+		// Treelets never leave the subtree of their root, so the biggest subtrees below
+		// the top of the tree can be optimized in parallel and the top afterwards
+		std::vector<int> subtrees{ 0 };
+		while (subtrees.size() < threadCount * 8)
 		{
-			BVHTriangle tri = m_bvhtriangles[i];
-			if (tri.center[splitAxis] < splitPos)
+			auto biggest = subtrees.end();
+			for (auto it = subtrees.begin(); it != subtrees.end(); ++it)
 			{
-				boundsLeft.GrowToInclude(tri.min, tri.max);
+				if (!IsLeaf(*it) && (biggest == subtrees.end() || Area(*it) > Area(*biggest)))
+					biggest = it;
+			}
+			if (biggest == subtrees.end())
+				break;
+			int index = *biggest;
+			*biggest = m_left[index];
+			subtrees.push_back(m_right[index]);
+		}
 
-				BVHTriangle swap = m_bvhtriangles[triGlobalStart + numOnLeft];
-				m_bvhtriangles[triGlobalStart + numOnLeft] = tri;
-				m_bvhtriangles[i] = swap;
-				numOnLeft++;
+		std::atomic<int> nextSubtree{ 0 };
+		std::vector<char> noSkip(m_nodes.size(), 0);
+		auto worker = [&]()
+		{
+			for (int i = nextSubtree++; i < subtrees.size(); i = nextSubtree++)
+			{
+				for (int index : PostOrder(subtrees[i], noSkip))
+					OptimizeTreelet(index);
 			}
-			else
+		};
+		std::vector<std::thread> threads;
+		for (int i = 0; i < threadCount; i++)
+			threads.push_back(std::thread(worker));
+		for (std::thread& thread : threads)
+			thread.join();
+
+		std::vector<char> skip(m_nodes.size(), 0);
+		for (int index : subtrees)
+			skip[index] = 1;
+		for (int index : PostOrder(0, skip))
+			OptimizeTreelet(index);
+	}
+}
+
+bool TreeletOptimizer::OptimizeTreelet(int root)
+{
+	// Grow the treelet by opening the leaf with the biggest surface area
+	Treelet treelet;
+	int leafCount = 2;
+	int internalCount = 1;
+	treelet.leaves[0] = m_left[root];
+	treelet.leaves[1] = m_right[root];
+	treelet.internals[0] = root;
+	while (leafCount < treeletLeafCount)
+	{
+		int biggest = -1;
+		for (int i = 0; i < leafCount; i++)
+		{
+			if (!IsLeaf(treelet.leaves[i]) && (biggest < 0 || Area(treelet.leaves[i]) > Area(treelet.leaves[biggest])))
+				biggest = i;
+		}
+		if (biggest < 0)
+			break;
+		int index = treelet.leaves[biggest];
+		treelet.internals[internalCount++] = index;
+		treelet.leaves[biggest] = m_left[index];
+		treelet.leaves[leafCount++] = m_right[index];
+	}
+	if (leafCount < 3)
+		return false;
+
+	// Best cost of every subset of the leaves, smaller subsets always have smaller masks
+	const int subsetCount = 1 << leafCount;
+	glm::vec3 boundsMin[1 << treeletLeafCount];
+	glm::vec3 boundsMax[1 << treeletLeafCount];
+	float cost[1 << treeletLeafCount];
+	int height[1 << treeletLeafCount];
+	for (int subset = 1; subset < subsetCount; subset++)
+	{
+		int lowest = subset & -subset;
+		int rest = subset ^ lowest;
+		int leaf = 0;
+		while ((1 << leaf) != lowest)
+			leaf++;
+		const BLAS::Node& leafNode = m_nodes[treelet.leaves[leaf]];
+		if (rest == 0)
+		{
+			boundsMin[subset] = leafNode.boundsMin;
+			boundsMax[subset] = leafNode.boundsMax;
+			cost[subset] = m_cost[treelet.leaves[leaf]];
+			height[subset] = m_height[treelet.leaves[leaf]];
+			continue;
+		}
+		boundsMin[subset] = glm::min(boundsMin[rest], leafNode.boundsMin);
+		boundsMax[subset] = glm::max(boundsMax[rest], leafNode.boundsMax);
+
+		// Every split is seen twice, only look at the ones with the lowest leaf on the left
+		float bestCost = INFINITY;
+		int bestPartition = lowest;
+		for (int part = (subset - 1) & subset; part > 0; part = (part - 1) & subset)
+		{
+			if (!(part & lowest))
+				continue;
+			float partCost = cost[part] + cost[subset ^ part];
+			if (partCost < bestCost)
 			{
-				boundsRight.GrowToInclude(tri.min, tri.max);
+				bestCost = partCost;
+				bestPartition = part;
 			}
 		}
+		cost[subset] = nodeTraversalCost * HalfArea(boundsMin[subset], boundsMax[subset]) + bestCost;
+		height[subset] = 1 + std::max(height[bestPartition], height[subset ^ bestPartition]);
+		treelet.partition[subset] = bestPartition;
+	}
+
+	// Must stay within the traversal stack of the shaders
+	int all = subsetCount - 1;
+	if (!(cost[all] < m_cost[root] * 0.9999f) || m_depth[root] + height[all] > BLAS::maxTreeDepth)
+		return false;
 
-		int numOnRight = triNum - numOnLeft;
-		int triStartLeft = triGlobalStart + 0;
-		int triStartRight = triGlobalStart + numOnLeft;
+	int nextInternal = 0;
+	Rebuild(treelet, all, nextInternal);
+	return true;
+}
 
-		// Split parent into two children
-		int childIndexLeft = m_nodes.Add(Node(boundsLeft, triStartLeft, 0));
-		int childIndexRight = m_nodes.Add(Node(boundsRight, triStartRight, 0));
+int TreeletOptimizer::Rebuild(const Treelet& treelet, int subset, int& nextInternal)
+{
+	if ((subset & (subset - 1)) == 0)
+	{
+		int leaf = 0;
+		while ((1 << leaf) != subset)
+			leaf++;
+		return treelet.leaves[leaf];
+	}
+	// The treelet root comes first so it keeps its index
+	int index = treelet.internals[nextInternal++];
+	int part = treelet.partition[subset];
+	m_left[index] = Rebuild(treelet, part, nextInternal);
+	m_right[index] = Rebuild(treelet, subset ^ part, nextInternal);
+	UpdateNode(index);
+	return index;
+}
 
-		// Update parent
-		parent.startIndex = childIndexLeft;
-		m_nodes.nodes[parentIndex] = parent;
-		//stats.RecordNode(depth, false);
+std::vector<BLAS::Node> TreeletOptimizer::GetNodes() const
+{
+	std::vector<BLAS::Node> nodes;
+	nodes.reserve(m_nodes.size());
+	nodes.push_back(m_nodes[0]);
 
-		// Recursively split children
-		Split(childIndexLeft, triangles, triGlobalStart, numOnLeft, depth + 1);
-		Split(childIndexRight, triangles, triGlobalStart + numOnLeft, numOnRight, depth + 1);
+	// (new index, old index), sibling pairs in depth first order
+	std::vector<std::pair<int, int>> stack{ { 0, 0 } };
+	while (!stack.empty())
+	{
+		int nodeIndex = stack.back().first;
+		int oldIndex = stack.back().second;
+		stack.pop_back();
+		if (IsLeaf(oldIndex))
+			continue;
+
+		// The old split axis is gone, take the one the children are furthest apart on
+		int left = m_left[oldIndex];
+		int right = m_right[oldIndex];
+		glm::vec3 offset = m_nodes[right].CalculateBoundsCentre() - m_nodes[left].CalculateBoundsCentre();
+		glm::vec3 distance = glm::abs(offset);
+		int axis = distance.x > distance.y ? (distance.x > distance.z ? 0 : 2) : (distance.y > distance.z ? 1 : 2);
+		if (offset[axis] < 0)
+			std::swap(left, right);
+
+		int first = nodes.size();
+		nodes[nodeIndex].startIndex = first;
+		nodes[nodeIndex].triangleCount = 0;
+		nodes[nodeIndex].splitAxis = axis;
+		nodes.push_back(m_nodes[left]);
+		nodes.push_back(m_nodes[right]);
+		stack.push_back({ first + 1, right });
+		stack.push_back({ first, left });
 	}
-	else
+	return nodes;
+}
+
+void BLAS::OptimizeTreelets(int passes)
+{
+	double startTime = TimeMs();
+	TreeletOptimizer optimizer{ m_nodes.nodes, m_nodeLayout };
+	float costBefore = optimizer.SAHCost();
+	optimizer.Optimize(passes);
+	m_nodes.nodes = optimizer.GetNodes();
+	m_nodeLayout = NodeLayout::DepthFirst;
+	m_buildTimes.optimize = TimeMs() - startTime;
+	std::cout << "Treelet optimization: sah " << costBefore << " -> " << optimizer.SAHCost() << " in " << m_buildTimes.optimize << "ms\n";
+}
+
+void BLAS::OptimizeTreeletNodes(std::vector<Node>& nodes, NodeLayout layout, int passes)
+{
+	TreeletOptimizer optimizer{ nodes, layout };
+	optimizer.Optimize(passes);
+	nodes = optimizer.GetNodes();
+}
+
+float BLAS::SAHCost(const std::vector<Node>& nodes, NodeLayout layout)
+{
+	return TreeletOptimizer{ nodes, layout }.SAHCost();
+}
+
+std::vector<BLAS::PairNode> BLAS::ToPairNodes(const std::vector<Node>& nodes, NodeLayout layout)
+{
+	std::vector<PairNode> pairs;
+	if (nodes.empty())
+		return pairs;
+
+	if (nodes[0].triangleCount > 0)
+	{
+		// The right half gets a box at infinity, no ray can get closer to it than INFINITY
+		const float inf = INFINITY;
+		PairNode root = {
+			nodes[0].boundsMin, nodes[0].startIndex,
+			nodes[0].boundsMax, nodes[0].triangleCount,
+			glm::vec3(inf), -1,
+			glm::vec3(inf), 0,
+		};
+		pairs.push_back(root);
+		return pairs;
+	}
+
+	// Every parent becomes one pair node, in the same order as in nodes
+	std::vector<int> pairIndex(nodes.size(), -1);
+	int pairCount = 0;
+	for (int i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i].triangleCount <= 0)
+			pairIndex[i] = pairCount++;
+	}
+
+	pairs.reserve(pairCount);
+	for (int i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i].triangleCount > 0)
+			continue;
+		int left, right;
+		GetChildren(nodes, i, layout, &left, &right);
+		const Node& a = nodes[left];
+		const Node& b = nodes[right];
+		PairNode pair = {
+			a.boundsMin, a.triangleCount > 0 ? a.startIndex : pairIndex[left],
+			a.boundsMax, std::max(a.triangleCount, 0),
+			b.boundsMin, b.triangleCount > 0 ? b.startIndex : pairIndex[right],
+			b.boundsMax, std::max(b.triangleCount, 0),
+		};
+		pairs.push_back(pair);
+	}
+	return pairs;
+}
+
+std::vector<BLAS::Node> BLAS::FromPairNodes(const std::vector<PairNode>& pairs)
+{
+	std::vector<Node> nodes;
+	if (pairs.empty())
+		return nodes;
+
+	const PairNode& rootPair = pairs[0];
+	if (rootPair.rightStart < 0)
+	{
+		nodes.push_back(Node(BoundingBox{ rootPair.leftMin, rootPair.leftMax, true }, rootPair.leftStart, rootPair.leftCount));
+		return nodes;
+	}
+
+	BoundingBox rootBounds{};
+	rootBounds.GrowToInclude(rootPair.leftMin, rootPair.leftMax);
+	rootBounds.GrowToInclude(rootPair.rightMin, rootPair.rightMax);
+	nodes.reserve(pairs.size() * 2 + 1);
+	nodes.push_back(Node(rootBounds));
+
+	// (node, its pair node), the left child is expanded first so sibling pairs end up depth first
+	std::vector<std::pair<int, int>> stack{ { 0, 0 } };
+	while (!stack.empty())
+	{
+		int nodeIndex = stack.back().first;
+		const PairNode& pair = pairs[stack.back().second];
+		stack.pop_back();
+
+		int first = nodes.size();
+		nodes[nodeIndex].startIndex = first;
+		nodes.push_back(Node(BoundingBox{ pair.leftMin, pair.leftMax, true }, pair.leftCount > 0 ? pair.leftStart : 0, pair.leftCount));
+		nodes.push_back(Node(BoundingBox{ pair.rightMin, pair.rightMax, true }, pair.rightCount > 0 ? pair.rightStart : 0, pair.rightCount));
+		if (pair.rightCount == 0)
+			stack.push_back({ first + 1, pair.rightStart });
+		if (pair.leftCount == 0)
+			stack.push_back({ first, pair.leftStart });
+	}
+	return nodes;
+}
+
+void BLAS::TraversalStats::Access(const void* address, size_t size)
+{
+	const size_t lineSize = 64;
+	size_t first = (size_t)address / lineSize;
+	size_t last = ((size_t)address + size - 1) / lineSize;
+	for (size_t line = first; line <= last; line++)
+	{
+		// Zero means empty so the tags are offset by one
+		size_t& slot = cacheLines[line % cacheLines.size()];
+		if (slot != line + 1)
+		{
+			slot = line + 1;
+			cacheMisses++;
+		}
+	}
+}
+
+static float RayBoxDist(glm::vec3 origin, glm::vec3 invDir, glm::vec3 boxMin, glm::vec3 boxMax)
+{
+	glm::vec3 tMin = (boxMin - origin) * invDir;
+	glm::vec3 tMax = (boxMax - origin) * invDir;
+	glm::vec3 t1 = glm::min(tMin, tMax);
+	glm::vec3 t2 = glm::max(tMin, tMax);
+	float tNear = std::max(std::max(t1.x, t1.y), t1.z);
+	float tFar = std::min(std::min(t2.x, t2.y), t2.z);
+	bool hit = tFar >= tNear && tFar > 0;
+	return hit ? (tNear > 0 ? tNear : 0) : INFINITY;
+}
+
+float RayTriangleDist(glm::vec3 origin, glm::vec3 dir, const Triangle& tri)
+{
+	const float epsilon = 1e-6f;
+	glm::vec3 vertA = glm::vec3(tri.vertA);
+	glm::vec3 edge1 = glm::vec3(tri.vertB) - vertA;
+	glm::vec3 edge2 = glm::vec3(tri.vertC) - vertA;
+	glm::vec3 rayCrossE2 = glm::cross(dir, edge2);
+	float det = glm::dot(edge1, rayCrossE2);
+	if (det > -epsilon && det < epsilon)
+		return INFINITY;
+	float invDet = 1.0f / det;
+	glm::vec3 s = origin - vertA;
+	float u = invDet * glm::dot(s, rayCrossE2);
+	if (u < 0 || u > 1)
+		return INFINITY;
+	glm::vec3 sCrossE1 = glm::cross(s, edge1);
+	float v = invDet * glm::dot(dir, sCrossE1);
+	if (v < 0 || u + v > 1)
+		return INFINITY;
+	float t = invDet * glm::dot(edge2, sCrossE1);
+	return t > epsilon ? t : INFINITY;
+}
+
+float BLAS::IntersectRay(
+	const std::vector<Node>& nodes,
+	const std::vector<Triangle>& triangles,
+	const std::vector<int>& references,
+	NodeLayout layout,
+	glm::vec3 origin,
+	glm::vec3 dir,
+	float maxDist,
+	TraversalStats* stats)
+{
+	glm::vec3 invDir = 1.0f / dir;
+	float closest = maxDist;
+
+	int stack[traversalStackSize];
+	int stackIndex = 0;
+	stack[stackIndex++] = 0;
+	while (stackIndex > 0)
+	{
+		int index = stack[--stackIndex];
+		const Node& node = nodes[index];
+		stats->nodesVisited++;
+		stats->Access(&node, sizeof(Node));
+
+		if (node.triangleCount > 0)
+		{
+			for (int i = 0; i < node.triangleCount; i++)
+			{
+				int triIndex = node.startIndex + i;
+				if (!references.empty())
+				{
+					stats->Access(&references[triIndex], sizeof(int));
+					triIndex = references[triIndex];
+				}
+				const Triangle& tri = triangles[triIndex];
+				stats->trianglesTested++;
+				stats->Access(&tri, sizeof(Triangle));
+				closest = std::min(closest, RayTriangleDist(origin, dir, tri));
+			}
+			continue;
+		}
+
+		int childIndexA, childIndexB;
+		GetChildren(nodes, index, layout, &childIndexA, &childIndexB);
+		const Node& childA = nodes[childIndexA];
+		const Node& childB = nodes[childIndexB];
+		stats->Access(&childA, sizeof(Node));
+		stats->Access(&childB, sizeof(Node));
+		float distA = RayBoxDist(origin, invDir, childA.boundsMin, childA.boundsMax);
+		float distB = RayBoxDist(origin, invDir, childB.boundsMin, childB.boundsMax);
+
+		// Closest child is pushed last so it is visited first
+		bool isNearestA = distA <= distB;
+		float distNear = isNearestA ? distA : distB;
+		float distFar = isNearestA ? distB : distA;
+		if (distFar < closest) stack[stackIndex++] = isNearestA ? childIndexB : childIndexA;
+		if (distNear < closest) stack[stackIndex++] = isNearestA ? childIndexA : childIndexB;
+	}
+	return closest;
+}
+
+void BLAS::SplitReferences(const Model& model, int maxReferences)
+{
+	struct Candidate
+	{
+		float emptyArea; // Of the box, not covered by the triangle
+		int reference;
+		bool operator<(const Candidate& other) const { return emptyArea < other.emptyArea; }
+	};
+	std::priority_queue<Candidate> candidates;
+	auto addCandidate = [&](int reference, float area)
+	{
+		const BVHTriangle& ref = m_bvhtriangles[reference];
+		float boxArea = HalfArea(ref.min, ref.max);
+		// Degenerate triangles have nothing to gain
+		if (area > 0 && boxArea > splitAreaRatio * area)
+			candidates.push({ boxArea - area, reference });
+	};
+
+	m_referenceTriangles.resize(m_bvhtriangles.size());
+	for (int i = 0; i < m_bvhtriangles.size(); i++)
+	{
+		const Triangle& tri = model.triangles[i];
+		m_referenceTriangles[i] = i;
+		addCandidate(i, glm::length(glm::cross(glm::vec3(tri.vertB - tri.vertA), glm::vec3(tri.vertC - tri.vertA))) * 0.5f);
+	}
+
+	m_bvhtriangles.reserve(maxReferences);
+	m_referenceTriangles.reserve(maxReferences);
+	while (!candidates.empty() && m_bvhtriangles.size() < maxReferences)
+	{
+		int reference = candidates.top().reference;
+		candidates.pop();
+
+		// Halve the box along its longest axis and clip the triangle to both halves
+		BVHTriangle ref = m_bvhtriangles[reference];
+		glm::vec3 size = ref.max - ref.min;
+		int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+		glm::vec3 leftMax = ref.max;
+		glm::vec3 rightMin = ref.min;
+		leftMax[axis] = rightMin[axis] = (ref.min[axis] + ref.max[axis]) / 2.0f;
+
+		const Triangle& tri = model.triangles[m_referenceTriangles[reference]];
+		BoundingBox left, right;
+		float leftArea, rightArea;
+		// Only misses a half if the box was already as tight as float allows, stop splitting it
+		if (!ClipTriangle(tri, ref.min, leftMax, &left, &leftArea) ||
+			!ClipTriangle(tri, rightMin, ref.max, &right, &rightArea))
+			continue;
+
+		m_bvhtriangles[reference] = BVHTriangle(left.min, left.max, left.Center());
+		m_bvhtriangles.push_back(BVHTriangle(right.min, right.max, right.Center()));
+		m_referenceTriangles.push_back(m_referenceTriangles[reference]);
+		addCandidate(reference, leftArea);
+		addCandidate(m_bvhtriangles.size() - 1, rightArea);
+	}
+	std::cout << "Split " << model.triangles.size() << " triangles into " << m_bvhtriangles.size() << " references\n";
+}
+
+bool BLAS::Build()
+{
+	// A binary tree over N leaves has at most 2N - 1 nodes, reserving that up front
+	// means the node list never reallocates and node references stay valid
+	int triangleCount = m_bvhtriangles.size();
+	m_nodes.nodes.reserve(std::max(1, 2 * triangleCount - 1));
+	m_triangleIndices.resize(triangleCount);
+	for (int i = 0; i < triangleCount; i++)
+		m_triangleIndices[i] = i;
+
+	// Halving the triangles at every level has to get them down to m_maxLeafSize by the depth cap
+	if ((long long)triangleCount > (long long)m_maxLeafSize << m_maxNodeDepth)
+	{
+		std::cerr << "Error: " << triangleCount << " triangles don't fit in leaves of " << m_maxLeafSize << " at depth " << m_maxNodeDepth << "\n";
+		return false;
+	}
+
+	// Depth first with an explicit stack, the right child is pushed first so nodes
+	// are numbered in the same order as a recursive build would
+	std::vector<BuildTask> tasks;
+	tasks.reserve(m_maxNodeDepth + 2);
+	tasks.push_back({ m_nodes.Add(Node(m_bounds)), 0, triangleCount, 0 });
+	int depthMax = 0;
+	while (!tasks.empty())
+	{
+		BuildTask task = tasks.back();
+		tasks.pop_back();
+		depthMax = std::max(depthMax, task.depth);
+		BuildTask left;
+		BuildTask right;
+		if (Split(task, &left, &right))
+		{
+			tasks.push_back(right);
+			tasks.push_back(left);
+		}
+	}
+	m_nodeCount = m_nodes.nodes.size();
+	m_triangleCount = triangleCount;
+	m_referenceCount = triangleCount;
+
+	size_t buildBytes =
+		m_bvhtriangles.capacity() * sizeof(BVHTriangle) +
+		m_referenceTriangles.capacity() * sizeof(int) +
+		m_triangleIndices.capacity() * sizeof(int) +
+		m_nodes.nodes.capacity() * sizeof(Node);
+	std::cout << "Build memory = " << buildBytes / (1024.0 * 1024.0) << " MB\n";
+
+	int startIndexMax = 0;
+	int triangleCountMax = 0;
+	for (int i = 0; i < m_nodes.nodes.size(); i++)
+	{
+		const BLAS::Node& node = m_nodes.nodes[i];
+		if (node.startIndex > startIndexMax) startIndexMax = node.startIndex;
+		if (node.triangleCount > triangleCountMax) triangleCountMax = node.triangleCount;
+	}
+	std::cout << "depthMax = " << depthMax << "\n";
+	std::cout << "startIndexMax = " << startIndexMax << "\n";
+	std::cout << "triangleCountMax = " << triangleCountMax << "\n";
+
+	// Split() keeps every node within what its remaining depth can halve down to m_maxLeafSize
+	if (triangleCountMax > m_maxLeafSize)
+	{
+		std::cerr << "Error: leaves have up to " << triangleCountMax << " triangles, more than the max of " << m_maxLeafSize << "\n";
+		return false;
+	}
+	return true;
+}
+
+bool BLAS::Split(const BuildTask& task, BuildTask* out_left, BuildTask* out_right)
+{
+	const int triGlobalStart = task.triStart;
+	const int triNum = task.triCount;
+	const Node& parent = m_nodes.nodes[task.nodeIndex];
+
+	bool canSplit = task.depth < m_maxNodeDepth && triNum > m_minLeafSize;
+	bool forceSplit = canSplit && triNum > m_maxLeafSize;
+	// Most triangles a child can have and still be split down to m_maxLeafSize before the depth cap
+	long long childMax = canSplit ? (long long)m_maxLeafSize << (m_maxNodeDepth - task.depth - 1) : 0;
+	int numOnLeft = -1;
+	int splitAxis = 0;
+	if (canSplit)
+	{
+		glm::vec3 size = parent.CalculateBoundsSize();
+		float parentCost = NodeCost(size, triNum);
+
+		float splitPos = 0;
+		float cost = 0;
+		ChooseSplit(&splitAxis, &splitPos, &cost, parent, triGlobalStart, triNum);
+
+		if (cost < parentCost)
+			numOnLeft = PartitionSplit(splitAxis, splitPos, triGlobalStart, triNum);
+		// Too big to be a leaf but the sah found nothing useful, or a side too big for the depth
+		// left, fall back to the object median
+		bool isUseless = numOnLeft <= 0 || numOnLeft >= triNum;
+		bool isTooDeep = numOnLeft >= 0 && std::max(numOnLeft, triNum - numOnLeft) > childMax;
+		if (forceSplit && (isUseless || isTooDeep))
+			numOnLeft = PartitionMedian(parent, triGlobalStart, triNum, &splitAxis);
+	}
+
+	if (numOnLeft < 0)
 	{
 		// Parent is actually leaf, assign all triangles to it
-		parent.startIndex = triGlobalStart;
-		parent.triangleCount = triNum;
-		m_nodes.nodes[parentIndex] = parent;
+		Node& leaf = m_nodes.nodes[task.nodeIndex];
+		leaf.startIndex = triGlobalStart;
+		leaf.triangleCount = triNum;
 		//stats.RecordNode(depth, true, triNum);
+		return false;
+	}
+
+	int numOnRight = triNum - numOnLeft;
+	int triStartLeft = triGlobalStart + 0;
+	int triStartRight = triGlobalStart + numOnLeft;
+
+	BoundingBox boundsLeft{};
+	BoundingBox boundsRight{};
+	for (int i = triStartLeft; i < triStartRight; i++)
+		boundsLeft.GrowToInclude(m_bvhtriangles[m_triangleIndices[i]].min, m_bvhtriangles[m_triangleIndices[i]].max);
+	for (int i = triStartRight; i < triGlobalStart + triNum; i++)
+		boundsRight.GrowToInclude(m_bvhtriangles[m_triangleIndices[i]].min, m_bvhtriangles[m_triangleIndices[i]].max);
+
+	// Split parent into two children
+	int childIndexLeft = m_nodes.Add(Node(boundsLeft, triStartLeft, 0));
+	int childIndexRight = m_nodes.Add(Node(boundsRight, triStartRight, 0));
+
+	// Update parent
+	m_nodes.nodes[task.nodeIndex].startIndex = childIndexLeft;
+	m_nodes.nodes[task.nodeIndex].splitAxis = splitAxis;
+	//stats.RecordNode(depth, false);
+
+	*out_left = { childIndexLeft, triStartLeft, numOnLeft, task.depth + 1 };
+	*out_right = { childIndexRight, triStartRight, numOnRight, task.depth + 1 };
+	return true;
+}
+
+int BLAS::PartitionSplit(int splitAxis, float splitPos, int start, int count)
+{
+	// Partition the indices in place, the triangles themselves never move
+	int numOnLeft = 0;
+	for (int i = start; i < start + count; i++)
+	{
+		if (m_bvhtriangles[m_triangleIndices[i]].center[splitAxis] < splitPos)
+		{
+			std::swap(m_triangleIndices[start + numOnLeft], m_triangleIndices[i]);
+			numOnLeft++;
+		}
 	}
+	return numOnLeft;
+}
 
+int BLAS::PartitionMedian(const Node& node, int start, int count, int* out_axis)
+{
+	glm::vec3 size = node.CalculateBoundsSize();
+	int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+	*out_axis = axis;
+	int half = count / 2;
+	std::nth_element(
+		m_triangleIndices.begin() + start,
+		m_triangleIndices.begin() + start + half,
+		m_triangleIndices.begin() + start + count,
+		[&](int a, int b) { return m_bvhtriangles[a].center[axis] < m_bvhtriangles[b].center[axis]; });
+	return half;
 }
 
 void BLAS::ChooseSplit(
@@ -227,7 +1180,7 @@ void BLAS::ChooseSplit(
 		for (int i = 0; i < numSplitTests; i++)
 		{
 			float splitT = (i + 1) / (numSplitTests + 1.0f);
-			float splitPos = Lerp(node.boundsMin[axis], node.boundsMax[axis], splitT);
+			float splitPos = glm::mix(node.boundsMin[axis], node.boundsMax[axis], splitT);
 			float cost = EvaluateSplit(axis, splitPos, start, count);
 			if (cost < bestCost)
 			{
@@ -252,7 +1205,7 @@ float BLAS::EvaluateSplit(int splitAxis, float splitPos, int start, int count)
 
 	for (int i = start; i < start + count; i++)
 	{
-		BVHTriangle tri = m_bvhtriangles[i];
+		const BVHTriangle& tri = m_bvhtriangles[m_triangleIndices[i]];
 		if (tri.center[splitAxis] < splitPos)
 		{
 			boundsLeft.GrowToInclude(tri.min, tri.max);
@@ -276,11 +1229,93 @@ float BLAS::NodeCost(glm::vec3 size, int numTriangles)
 	return halfArea * numTriangles;
 }
 
+void BLAS::CompactExtents(const BoundingBox& bounds, glm::vec3* out_boundsMin, glm::vec3* out_boundsExtent)
+{
+	*out_boundsMin = bounds.min;
+	// Flat models still need something to divide by
+	*out_boundsExtent = glm::max(bounds.Size(), glm::vec3(1e-6f));
+}
+
+// Still to be rounded to a 16 bit integer
+static float QuantizePosition(float position, float boundsMin, float boundsExtent)
+{
+	return glm::clamp((position - boundsMin) / boundsExtent * 65535.0f, 0.0f, 65535.0f);
+}
+
+static unsigned int QuantizeNormal(float component)
+{
+	return (unsigned int)glm::clamp(std::round((component + 1.0f) * 128.0f), 0.0f, 255.0f);
+}
+
+std::vector<TinyTriangle> BLAS::ToTinyTriangles(const std::vector<Triangle>& triangles, glm::vec3 boundsMin, glm::vec3 boundsExtent)
+{
+	auto position = [&](glm::vec4 vertex, int axis)
+	{
+		return (unsigned int)std::round(QuantizePosition(vertex[axis], boundsMin[axis], boundsExtent[axis]));
+	};
+	auto normal = [](glm::vec4 normal)
+	{
+		return QuantizeNormal(normal.x) | QuantizeNormal(normal.y) << 8 | QuantizeNormal(normal.z) << 16;
+	};
+
+	std::vector<TinyTriangle> tinyTriangles(triangles.size());
+	for (int i = 0; i < triangles.size(); i++)
+	{
+		const Triangle& tri = triangles[i];
+		unsigned int normA = normal(tri.normA);
+		unsigned int normB = normal(tri.normB);
+		TinyTriangle& tiny = tinyTriangles[i];
+		tiny.Avx_Avy = position(tri.vertA, 0) | position(tri.vertA, 1) << 16;
+		tiny.Bvx_Bvy = position(tri.vertB, 0) | position(tri.vertB, 1) << 16;
+		tiny.Cvx_Cvy = position(tri.vertC, 0) | position(tri.vertC, 1) << 16;
+		tiny.Avz_Bvz = position(tri.vertA, 2) | position(tri.vertB, 2) << 16;
+		tiny.Cvz_Anx_Any = position(tri.vertC, 2) | (normA & 0xFFFF) << 16;
+		tiny.Anz_Bnx_Bny_Bnz = normA >> 16 | normB << 8;
+		tiny.Cnx_Cny_Cnz = normal(tri.normC);
+		tiny.materialIndex = (unsigned int)tri.vertA.w;
+	}
+	return tinyTriangles;
+}
+
+bool BLAS::ToTinyNodes(const std::vector<Node>& nodes, glm::vec3 boundsMin, glm::vec3 boundsExtent, std::vector<TinyNode>* out_tinyNodes)
+{
+	out_tinyNodes->resize(nodes.size());
+	for (int i = 0; i < nodes.size(); i++)
+	{
+		const Node& node = nodes[i];
+		if (node.startIndex >= 1 << 24 || node.triangleCount > 255)
+			return false;
+		unsigned int low[3];
+		unsigned int high[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			low[axis] = (unsigned int)std::floor(QuantizePosition(node.boundsMin[axis], boundsMin[axis], boundsExtent[axis]));
+			high[axis] = (unsigned int)std::ceil(QuantizePosition(node.boundsMax[axis], boundsMin[axis], boundsExtent[axis]));
+		}
+		TinyNode& tiny = (*out_tinyNodes)[i];
+		tiny.mix_max = low[0] | high[0] << 16;
+		tiny.miy_may = low[1] | high[1] << 16;
+		tiny.miz_maz = low[2] | high[2] << 16;
+		tiny.startIndex24_triangleCount8 = node.startIndex | std::max(node.triangleCount, 0) << 24;
+	}
+	return true;
+}
+
 
 
 
+glm::mat4 CreateWorldToLocalMatrix(glm::vec3 position, glm::vec3 rotation, glm::vec3 scale)
+{
+	glm::mat4 w = glm::mat4(1.0f);
+	w = glm::scale(w, 1.0f / scale);
+	w = glm::rotate(w, rotation.z, glm::vec3(0, 0, 1));
+	w = glm::rotate(w, rotation.y, glm::vec3(0, 1, 0));
+	w = glm::rotate(w, rotation.x, glm::vec3(1, 0, 0));
+	w = glm::translate(w, -position);
+	return glm::transpose(w);
+}
+
 RayTraceModel::RayTraceModel(
-	const BLAS& model_blas,
 	glm::vec3 albedo,
 	float specular,
 	int flags,
@@ -290,17 +1325,13 @@ RayTraceModel::RayTraceModel(
 {
 	nodeOffset = 0;
 	triOffset = 0;
+	referenceOffset = 0;
+	boundsMin = glm::vec3(0.0f);
+	boundsExtent = glm::vec3(1.0f);
 	albedoSpecular = glm::vec4(albedo, specular);
 	this->flags = flags;
-	glm::mat4 w = glm::mat4(1.0f);
-	w = glm::scale(w, 1.0f / scale);
-	w = glm::rotate(w, rotation.z, glm::vec3(0, 0, 1));
-	w = glm::rotate(w, rotation.y, glm::vec3(0, 1, 0));
-	w = glm::rotate(w, rotation.x, glm::vec3(1, 0, 0));
-	w = glm::translate(w, -position);
-	w = glm::transpose(w);
-	worldToLocalMatrix = w;
-	localToWorldMatrix = glm::inverse(w);
+	worldToLocalMatrix = CreateWorldToLocalMatrix(position, rotation, scale);
+	localToWorldMatrix = glm::inverse(worldToLocalMatrix);
 }
 
 
@@ -320,11 +1351,11 @@ Model LoadModel(const char* const filepath)
 	std::vector<glm::vec4> verts;
 	std::vector<glm::vec4> normals;
 
-	while (!f.eof())
+	char line[128];
+	int lineNumber = 0;
+	while (f.getline(line, 128))
 	{
-		char line[128];
-		f.getline(line, 128);
-
+		lineNumber++;
 		std::strstream s;
 		s << line;
 
@@ -349,9 +1380,19 @@ Model LoadModel(const char* const filepath)
 			int f[3];
 			int n[3];
 			s >> junk >> f[0] >> n[0] >> f[1] >> n[1] >> f[2] >> n[2];
+			// Every face needs a vertex and a normal index per corner
+			bool isValid = !s.fail();
+			for (int i = 0; i < 3 && isValid; i++)
+				isValid = f[i] >= 1 && f[i] <= (int)verts.size() && n[i] >= 1 && n[i] <= (int)normals.size();
+			if (!isValid)
+			{
+				std::cout << filepath << " line " << lineNumber << ": not a face of three vertex and normal indices that exist!\n";
+				return Model();
+			}
 
 			Triangle tri{};
 			tri.vertA = verts[f[0] - 1];
+			tri.vertA.w = 0; // The first material of the scene, see SceneMaterial in buffer.hpp
 			tri.vertB = verts[f[1] - 1];
 			tri.vertC = verts[f[2] - 1];
 			tri.normA = normals[n[0] - 1];
@@ -360,95 +1401,46 @@ Model LoadModel(const char* const filepath)
 			model.triangles.push_back(tri);
 		}
 	}
+	// getline() also stops at a line too long for the buffer
+	if (!f.eof())
+	{
+		std::cout << filepath << " line " << lineNumber + 1 << ": could not be read!\n";
+		return Model();
+	}
 
 	return model;
 }
 
 
 
-bool BuildAndDoEverythingElseWithBVH()
+static glm::vec3 TriangleCenter(const Triangle& tri)
+{
+	return glm::vec3(tri.vertA + tri.vertB + tri.vertC) / 3.0f;
+}
+
+void PartitionTriangles(std::vector<Triangle>& triangles, int start, int count, int maxCount, std::vector<int>& out_partSizes)
 {
-	Model testo = LoadModel("ringworld2.OBJ_MODEL");
-	/*BoundingBox modelBounds{};
-	for (int i = 0; i < testo.triangles.size(); i++)
+	if (count <= maxCount)
 	{
-		const Triangle& tri = testo.triangles[i];
-		glm::vec3 boundsMin = glm::min(glm::min(tri.vertA, tri.vertB), tri.vertC);
-		glm::vec3 boundsMax = glm::max(glm::max(tri.vertA, tri.vertB), tri.vertC);
-		modelBounds.GrowToInclude(boundsMin, boundsMax);
-	}
-	Model testoScaled{};
-	for (int i = 0; i < testo.triangles.size(); i++)
-	{
-		Triangle tri = testo.triangles[i];
-		Triangle scaledTri;
-		glm::vec4 scale = glm::vec4(1.0f / modelBounds.Size(), 1);
-		scaledTri.vertA = tri.vertA * scale + glm::vec4(0.5f, 0.5f, 0.5f, 0);
-		scaledTri.vertB = tri.vertB * scale + glm::vec4(0.5f, 0.5f, 0.5f, 0);
-		scaledTri.vertC = tri.vertC * scale + glm::vec4(0.5f, 0.5f, 0.5f, 0);
-		scaledTri.normA = tri.normA;
-		scaledTri.normB = tri.normB;
-		scaledTri.normC = tri.normC;
-		testoScaled.triangles.push_back(scaledTri);
-	}*/
-	BLAS testoBLAS{ testo, 23 };
-	
-	std::vector<RayTraceModel> modelsBuffer;
-	modelsBuffer.push_back(RayTraceModel(testoBLAS,
-		glm::vec3(1.0f, 1.0f, 1.0f),
-		0.5f,
-		0,
-		glm::vec3(0, 0, 0),
-		glm::vec3(0, 0, 0),
-		glm::vec3(1, 1, 1)));
-
-	//std::cout << "Model bounds = " << modelBounds.Size().x << ", " << modelBounds.Size().y << ", " << modelBounds.Size().z << "\n";
-	
-	//exit(0);
-
-	/*std::vector<TinyTriangle> tinyTriangleBuffer;
-	for (int i = 0; i < testoScaled.triangles.size(); i++)
-	{
-		Triangle tri = testoScaled.triangles[i];
-		TinyTriangle tiny = { 0 };
-		tiny.Avx_Avy |= unsigned short(tri.vertA.x * 65535.0f) << 0;
-		tiny.Avx_Avy |= unsigned short(tri.vertA.y * 65535.0f) << 16;
-		tiny.Bvx_Bvy |= unsigned short(tri.vertB.x * 65535.0f) << 0;
-		tiny.Bvx_Bvy |= unsigned short(tri.vertB.y * 65535.0f) << 16;
-		tiny.Cvx_Cvy |= unsigned short(tri.vertC.x * 65535.0f) << 0;
-		tiny.Cvx_Cvy |= unsigned short(tri.vertC.y * 65535.0f) << 16;
-		tiny.Avz_Bvz |= unsigned short(tri.vertA.z * 65535.0f) << 0;
-		tiny.Avz_Bvz |= unsigned short(tri.vertB.z * 65535.0f) << 16;
-		tiny.Cvz_Anx_Any |= unsigned short(tri.vertC.z * 65535.0f) << 0;
-		tiny.Cvz_Anx_Any |= unsigned char(tri.normA.x * 0.5f) << 0;
-
-	}*/
-
-
-	CreateBufferAndCount(
-		"models_buffer",
-		5,
-		modelsBuffer.size(),
-		sizeof(RayTraceModel) * modelsBuffer.size(),
-		(void*)modelsBuffer.data());
-
-	CreateBufferAndCount(
-		"triangle_buffer",
-		6,
-		testoBLAS.m_orderedTriangles.size(),
-		sizeof(Triangle) * testoBLAS.m_orderedTriangles.size(),
-		(void*)testoBLAS.m_orderedTriangles.data());
-
-	CreateBufferAndCount(
-		"nodes_buffer",
-		7,
-		testoBLAS.m_nodes.nodes.size(),
-		sizeof(BLAS::Node) * testoBLAS.m_nodes.nodes.size(),
-		(void*)testoBLAS.m_nodes.nodes.data());
-
-	//CreateBuffer("node_buffer", 7, 0, 0);
-
-	//std::cout << "glGetError() = " << glGetError() << "\n";
-
-	return false;
+		out_partSizes.push_back(count);
+		return;
+	}
+
+	BoundingBox centerBounds{};
+	for (int i = start; i < start + count; i++)
+	{
+		glm::vec3 center = TriangleCenter(triangles[i]);
+		centerBounds.GrowToInclude(center, center);
+	}
+	glm::vec3 size = centerBounds.Size();
+	int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+	int half = count / 2;
+	std::nth_element(
+		triangles.begin() + start,
+		triangles.begin() + start + half,
+		triangles.begin() + start + count,
+		[axis](const Triangle& a, const Triangle& b) { return TriangleCenter(a)[axis] < TriangleCenter(b)[axis]; });
+	PartitionTriangles(triangles, start, half, maxCount, out_partSizes);
+	PartitionTriangles(triangles, start + half, count - half, maxCount, out_partSizes);
 }
@@ -5,6 +5,7 @@
 
 struct Triangle
 {
+	// vertA.w is the index into material_data
 	glm::vec4 vertA, vertB, vertC;
 	glm::vec4 normA, normB, normC;
 };
@@ -17,7 +18,7 @@ struct TinyTriangle
 	unsigned int Cvz_Anx_Any;
 	unsigned int Anz_Bnx_Bny_Bnz;
 	unsigned int Cnx_Cny_Cnz;
-	unsigned int _padding;
+	unsigned int materialIndex;
 };
 
 struct Model
@@ -38,6 +39,11 @@ struct BoundingBox
 	void GrowToInclude(glm::vec3 min, glm::vec3 max);
 };
 
+// Bounds and area of the part of the triangle inside the box, false if none of it is inside
+bool ClipTriangle(const Triangle& tri, glm::vec3 boxMin, glm::vec3 boxMax, BoundingBox* out_bounds, float* out_area);
+// Distance along dir to the hit with the triangle, INFINITY if there is none
+float RayTriangleDist(glm::vec3 origin, glm::vec3 dir, const Triangle& tri);
+
 // Bottom-level acceleration structure
 // Stores the triangle and bvh for a single model
 struct BLAS
@@ -49,13 +55,13 @@ struct BLAS
 		// Index of first child (if triangle count is negative) otherwise index of first triangle
 		int startIndex;
 		int triangleCount;
-		int _padding2;
+		int splitAxis; // Left child is on the low side of this axis
 		int _padding3;
 
 		Node(BoundingBox bounds);
 		Node(BoundingBox bounds, int _startIndex, int _triangleCount);
-		glm::vec3 CalculateBoundsSize();
-		glm::vec3 CalculateBoundsCentre();
+		glm::vec3 CalculateBoundsSize() const;
+		glm::vec3 CalculateBoundsCentre() const;
 	};
 	struct TinyNode
 	{
@@ -64,19 +70,60 @@ struct BLAS
 		unsigned int miz_maz;
 		unsigned int startIndex24_triangleCount8;
 	};
+	// Holds the bounds of both children of a node so one fetch is enough to test them.
+	// A child with triangleCount > 0 is a leaf and startIndex is its first triangle,
+	// otherwise startIndex is the pair node of the child. Pair node 0 holds the children
+	// of the root, or just the root in the left half if it is a leaf.
+	struct PairNode
+	{
+		glm::vec3 leftMin; int leftStart;
+		glm::vec3 leftMax; int leftCount;
+		glm::vec3 rightMin; int rightStart;
+		glm::vec3 rightMax; int rightCount;
+	};
 	struct BVHTriangle
 	{
 		glm::vec3 min;
 		glm::vec3 max;
 		glm::vec3 center;
-		int index;
-		BVHTriangle(glm::vec3 _min, glm::vec3 _max, glm::vec3 _center, int _index) :
+		BVHTriangle(glm::vec3 _min, glm::vec3 _max, glm::vec3 _center) :
 			min{ _min },
 			max{ _max },
-			center{ _center },
-			index{ _index }
+			center{ _center }
 		{}
 	};
+	// Order of the nodes in memory. Except for LeftChildImplicit the two children of a node
+	// are adjacent and startIndex points at the first one, with LeftChildImplicit the left
+	// child directly follows its parent and startIndex points at the right child
+	// (the shaders need BVH_LEFT_CHILD_IMPLICIT for it)
+	enum class NodeLayout
+	{
+		Build, // Creation order of the builder
+		BreadthFirst,
+		DepthFirst, // Sibling pairs in depth first order
+		LeftChildImplicit, // Depth first with the left child right after its parent
+		Treelet, // Subtrees of treeletSize nodes stored together
+	};
+	static const NodeLayout uploadLayout = NodeLayout::Treelet;
+	// Upload PairNodes instead of Nodes, the shaders need BVH_PAIR_NODES for it
+	static const bool uploadPairNodes = true;
+	// Run OptimizeTreelets() on every blas before it is uploaded
+	static bool optimizeTreelets;
+	static const int treeletPasses = 3;
+	// 16 nodes are 768 bytes, a few cache lines on the cpu and about one L1 line set on the gpu
+	static const int treeletSize = 16;
+
+	struct TraversalStats
+	{
+		long long nodesVisited = 0;
+		long long trianglesTested = 0;
+		// Node and triangle fetches missing a simulated 32 KB direct mapped cache with 64 byte lines
+		long long cacheMisses = 0;
+		std::vector<size_t> cacheLines = std::vector<size_t>(512, 0);
+
+		void Access(const void* address, size_t size);
+	};
+
 	struct NodeList
 	{
 		std::vector<Node> nodes;
@@ -84,22 +131,119 @@ struct BLAS
 
 		int Add(Node node);
 	};
+
+	// Upload TinyTriangles and TinyNodes instead of Triangles and Nodes, the shaders need
+	// COMPACT_DATA for it. There is no compact pair node.
+	static const bool uploadCompactData = false;
+	static_assert(!(uploadCompactData && uploadPairNodes), "TinyNodes can't be pair nodes");
 	
+	// The shaders traverse with an int stack[BVH_STACK_SIZE], a tree of depth d needs at
+	// most d + 1 entries so the build never goes deeper than maxTreeDepth
+	static const int traversalStackSize = 32;
+	static const int maxTreeDepth = traversalStackSize - 1;
+	// Limits of the TinyNode packing, 8 bits of triangle count and 24 bits of start index.
+	// At most 2N - 1 nodes per blas so bigger meshes are split into several blases.
+	static const int maxLeafTriangles = 255;
+	static const int maxBLASTriangles = 1 << 23;
+	// References to triangles whose box is more than splitAreaRatio times their area are split in
+	// half until presplitBudget extra references per triangle are used up. Leaves then index
+	// m_references instead of the triangles, the shaders need BVH_TRIANGLE_REFERENCES for it.
+	static float presplitBudget;
+	static const int splitAreaRatio = 4;
+
 	BoundingBox m_bounds;
+	// Stays in the original triangle order, the build only moves m_triangleIndices around.
+	// With a split budget these are references, the split ones come after the originals.
 	std::vector<BVHTriangle> m_bvhtriangles;
+	// Original triangle of each reference in m_bvhtriangles, empty without a split budget
+	std::vector<int> m_referenceTriangles;
+	// Original index of the i:th triangle (or reference) in leaf order
+	std::vector<int> m_triangleIndices;
+	// Each triangle once, in order of first use by the leaves
 	std::vector<Triangle> m_orderedTriangles;
+	// Index into m_orderedTriangles of the i:th reference in leaf order, empty without a split budget
+	std::vector<int> m_references;
 	NodeList m_nodes;
-	int m_maxNodeDepth;
+	int m_maxNodeDepth; // Clamped to maxTreeDepth
+	int m_minLeafSize; // Nodes with this many triangles or fewer are always leaves
+	int m_maxLeafSize; // Nodes with more triangles are split even if the sah says otherwise
+	NodeLayout m_nodeLayout;
+	// Still valid after ReleaseBuildData()
+	int m_nodeCount;
+	int m_triangleCount;
+	int m_referenceCount; // Same as m_triangleCount without a split budget
+	// False if the triangles don't fit the depth and leaf size limits, nothing else is then usable
+	bool m_built;
+	// Milliseconds spent in each phase of the build
+	struct BuildTimes
+	{
+		double bounds = 0; // Triangle bounds and centres
+		double presplit = 0;
+		double build = 0;
+		double gather = 0; // Copying the triangles into leaf order
+		double optimize = 0;
+		double reorder = 0;
+	} m_buildTimes;
 
-	BLAS(const Model& model, int maxNodeDepth);
+	BLAS(const Model& model, int maxNodeDepth = maxTreeDepth, int minLeafSize = 1, int maxLeafSize = maxLeafTriangles, float splitBudget = presplitBudget);
+	// Builds only the nodes over arbitrary primitive bounds, m_triangleIndices[i]
+	// then gives the original index of the i:th primitive in leaf order
+	BLAS(const std::vector<BoundingBox>& primitiveBounds, int maxNodeDepth = maxTreeDepth, int minLeafSize = 1, int maxLeafSize = maxLeafTriangles);
 
-private:
-	void Split(
-		int parentIndex,
+	// Frees the triangles and nodes once they are uploaded, only m_bounds and the counts are kept
+	void ReleaseBuildData();
+
+	void Reorder(NodeLayout layout);
+
+	// Rewrites every treelet of up to 7 leaves into its sah optimal shape, bottom up and
+	// split over all cores. Leaves the nodes in the DepthFirst layout.
+	void OptimizeTreelets(int passes = treeletPasses);
+	static void OptimizeTreeletNodes(std::vector<Node>& nodes, NodeLayout layout, int passes = treeletPasses);
+	// Expected cost of a random ray hitting the root, in triangle tests
+	static float SAHCost(const std::vector<Node>& nodes, NodeLayout layout);
+
+	static void GetChildren(const std::vector<Node>& nodes, int index, NodeLayout layout, int* out_left, int* out_right);
+
+	// Reorders a single tree stored in nodes from one layout to another, the root stays first
+	static void ReorderNodes(std::vector<Node>& nodes, NodeLayout from, NodeLayout to);
+
+	// The pair nodes keep the order of the parents in nodes, FromPairNodes() gives a DepthFirst tree
+	static std::vector<PairNode> ToPairNodes(const std::vector<Node>& nodes, NodeLayout layout);
+	static std::vector<Node> FromPairNodes(const std::vector<PairNode>& pairs);
+
+	// Closest hit distance of the ray with the tree or maxDist if nothing is hit, traverses
+	// exactly like RayTriangleBVH() in comp_common.glsl. The leaves index references if it is not empty.
+	static float IntersectRay(
+		const std::vector<Node>& nodes,
 		const std::vector<Triangle>& triangles,
-		int triGlobalStart,
-		int triNum,
-		int depth = 0);
+		const std::vector<int>& references,
+		NodeLayout layout,
+		glm::vec3 origin,
+		glm::vec3 dir,
+		float maxDist,
+		TraversalStats* stats);
+
+	// The compact data stores positions as 16 bit fractions of boundsExtent from boundsMin, with
+	// node boxes rounded outwards. ToTinyNodes() is false if a start index or leaf doesn't fit its bits.
+	static void CompactExtents(const BoundingBox& bounds, glm::vec3* out_boundsMin, glm::vec3* out_boundsExtent);
+	static std::vector<TinyTriangle> ToTinyTriangles(const std::vector<Triangle>& triangles, glm::vec3 boundsMin, glm::vec3 boundsExtent);
+	static bool ToTinyNodes(const std::vector<Node>& nodes, glm::vec3 boundsMin, glm::vec3 boundsExtent, std::vector<TinyNode>* out_tinyNodes);
+
+private:
+	struct BuildTask
+	{
+		int nodeIndex;
+		int triStart;
+		int triCount;
+		int depth;
+	};
+
+	// Splits the references with the most empty box area until there are maxReferences
+	void SplitReferences(const Model& model, int maxReferences);
+	bool Build();
+
+	// Turns the node of the task into a leaf, or into a parent and returns the child tasks
+	bool Split(const BuildTask& task, BuildTask* out_left, BuildTask* out_right);
 
 	void ChooseSplit(
 		int* out_axis,
@@ -111,17 +255,24 @@ private:
 
 	float EvaluateSplit(int splitAxis, float splitPos, int start, int count);
 
+	// Both return how many triangles ended up on the left
+	int PartitionSplit(int splitAxis, float splitPos, int start, int count);
+	int PartitionMedian(const Node& node, int start, int count, int* out_axis);
+
 	float NodeCost(glm::vec3 size, int numTriangles);
 
 };
 
 
 
+// Row vector convention of the shaders, a point is transformed by vec4(point, 1) * matrix
+glm::mat4 CreateWorldToLocalMatrix(glm::vec3 position, glm::vec3 rotation, glm::vec3 scale);
+
 struct RayTraceModel
 {
 	int nodeOffset;
 	int triOffset;
-	int _padding0;
+	int referenceOffset;
 	int _padding1;
 	glm::mat4 worldToLocalMatrix;
 	glm::mat4 localToWorldMatrix;
@@ -130,9 +281,11 @@ struct RayTraceModel
 	int _padding2;
 	int _padding3;
 	int _padding4;
+	// What the compact data of the blas is quantized over, see BLAS::CompactExtents()
+	glm::vec3 boundsMin; float _padding5;
+	glm::vec3 boundsExtent; float _padding6;
 
 	RayTraceModel(
-		const BLAS& model_blas,
 		glm::vec3 albedo = glm::vec3(1.0f, 0.0f, 0.5f),
 		float specular = 0.5f,
 		int flags = 0,
@@ -143,6 +296,9 @@ struct RayTraceModel
 
 
 
+// Empty if the file can't be read or has a face without valid vertex and normal indices
 Model LoadModel(const char* const filepath);
 
-bool BuildAndDoEverythingElseWithBVH();
+// Reorders the triangles so every consecutive run of at most maxCount triangles is
+// spatially coherent, out_partSizes gets the size of each run
+void PartitionTriangles(std::vector<Triangle>& triangles, int start, int count, int maxCount, std::vector<int>& out_partSizes);
@@ -0,0 +1,313 @@
+// Standalone tool that builds the BLAS of a model and reports how good the tree is as json,
+// so the quality of the acceleration structure can be tracked from commit to commit.
+//
+// BVHAnalyzer model.OBJ_MODEL [-depth n] [-minleaf n] [-maxleaf n] [-passes n] [-budget x] [-layout name] [-out file.json]
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdlib.h>
+
+#include <glm/glm.hpp>
+
+#include "bvh.hpp"
+
+
+
+struct AnalyzerSettings
+{
+	std::string modelPath;
+	std::string outPath; // Stdout if empty
+	int maxNodeDepth = BLAS::maxTreeDepth;
+	int minLeafSize = 1;
+	int maxLeafSize = BLAS::maxLeafTriangles;
+	int treeletPasses = BLAS::optimizeTreelets ? BLAS::treeletPasses : 0;
+	float splitBudget = BLAS::presplitBudget;
+	BLAS::NodeLayout layout = BLAS::uploadLayout;
+};
+
+static const char* const layoutNames[] = { "Build", "BreadthFirst", "DepthFirst", "LeftChildImplicit", "Treelet" };
+
+static bool ParseArguments(int argc, char** argv, AnalyzerSettings* out_settings)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "-depth" && hasValue)
+			out_settings->maxNodeDepth = atoi(argv[++i]);
+		else if (arg == "-minleaf" && hasValue)
+			out_settings->minLeafSize = atoi(argv[++i]);
+		else if (arg == "-maxleaf" && hasValue)
+			out_settings->maxLeafSize = atoi(argv[++i]);
+		else if (arg == "-passes" && hasValue)
+			out_settings->treeletPasses = atoi(argv[++i]);
+		else if (arg == "-budget" && hasValue)
+			out_settings->splitBudget = (float)atof(argv[++i]);
+		else if (arg == "-out" && hasValue)
+			out_settings->outPath = argv[++i];
+		else if (arg == "-layout" && hasValue)
+		{
+			std::string name = argv[++i];
+			auto found = std::find(std::begin(layoutNames), std::end(layoutNames), name);
+			if (found == std::end(layoutNames))
+				return false;
+			out_settings->layout = (BLAS::NodeLayout)(found - std::begin(layoutNames));
+		}
+		else if (arg[0] != '-' && out_settings->modelPath.empty())
+			out_settings->modelPath = arg;
+		else
+			return false;
+	}
+	return !out_settings->modelPath.empty();
+}
+
+
+
+static float HalfArea(glm::vec3 min, glm::vec3 max)
+{
+	glm::vec3 size = glm::max(max - min, glm::vec3(0));
+	return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+static bool BoxesOverlap(glm::vec3 minA, glm::vec3 maxA, glm::vec3 minB, glm::vec3 maxB)
+{
+	return glm::all(glm::lessThanEqual(minA, maxB)) && glm::all(glm::lessThanEqual(minB, maxA));
+}
+
+struct TreeStats
+{
+	int leafCount = 0;
+	int maxDepth = 0;
+	double averageLeafDepth = 0; // Weighted by triangle references
+	std::map<int, int> leafSizeHistogram;
+	std::map<int, int> leafDepthHistogram;
+	double childOverlap = 0; // Overlapping area of sibling boxes relative to the root
+	double epo = 0;
+};
+
+static TreeStats AnalyzeTree(const BLAS& blas)
+{
+	const std::vector<BLAS::Node>& nodes = blas.m_nodes.nodes;
+	const std::vector<Triangle>& triangles = blas.m_orderedTriangles;
+	const std::vector<int>& references = blas.m_references;
+	TreeStats stats;
+
+	// Depth first enter and exit numbers, a is an ancestor of b if its range contains b's
+	std::vector<int> enter(nodes.size(), 0);
+	std::vector<int> exit(nodes.size(), 0);
+	// A split triangle is in several leaves
+	std::vector<std::vector<int>> leavesOfTriangle(triangles.size());
+	std::vector<std::pair<int, int>> stack{ { 0, 0 } };
+	int counter = 0;
+	double totalLeafDepth = 0;
+	while (!stack.empty())
+	{
+		int index = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		if (index < 0)
+		{
+			exit[~index] = counter++;
+			continue;
+		}
+		enter[index] = counter++;
+		stack.push_back({ ~index, depth });
+
+		const BLAS::Node& node = nodes[index];
+		stats.maxDepth = std::max(stats.maxDepth, depth);
+		if (node.triangleCount > 0)
+		{
+			stats.leafCount++;
+			stats.leafSizeHistogram[node.triangleCount]++;
+			stats.leafDepthHistogram[depth]++;
+			totalLeafDepth += (double)depth * node.triangleCount;
+			for (int i = 0; i < node.triangleCount; i++)
+			{
+				int triangle = references.empty() ? node.startIndex + i : references[node.startIndex + i];
+				leavesOfTriangle[triangle].push_back(index);
+			}
+			continue;
+		}
+
+		int left, right;
+		BLAS::GetChildren(nodes, index, blas.m_nodeLayout, &left, &right);
+		glm::vec3 overlapMin = glm::max(nodes[left].boundsMin, nodes[right].boundsMin);
+		glm::vec3 overlapMax = glm::min(nodes[left].boundsMax, nodes[right].boundsMax);
+		if (glm::all(glm::lessThan(overlapMin, overlapMax)))
+			stats.childOverlap += HalfArea(overlapMin, overlapMax);
+		stack.push_back({ right, depth + 1 });
+		stack.push_back({ left, depth + 1 });
+	}
+	stats.averageLeafDepth = totalLeafDepth / std::max(blas.m_referenceCount, 1);
+	stats.childOverlap /= std::max(HalfArea(nodes[0].boundsMin, nodes[0].boundsMax), 1e-20f);
+
+	// Effective partition overlap (Aila et al. 2013), the area of geometry inside each node that
+	// does not belong to its subtree, weighted by the cost of visiting the node
+	double totalArea = 0;
+	double overlapCost = 0;
+	std::vector<int> nodeStack;
+	for (int t = 0; t < triangles.size(); t++)
+	{
+		const Triangle& tri = triangles[t];
+		glm::vec3 triMin = glm::min(glm::min(glm::vec3(tri.vertA), glm::vec3(tri.vertB)), glm::vec3(tri.vertC));
+		glm::vec3 triMax = glm::max(glm::max(glm::vec3(tri.vertA), glm::vec3(tri.vertB)), glm::vec3(tri.vertC));
+		totalArea += glm::length(glm::cross(glm::vec3(tri.vertB - tri.vertA), glm::vec3(tri.vertC - tri.vertA))) * 0.5;
+		const std::vector<int>& leaves = leavesOfTriangle[t];
+
+		nodeStack.assign(1, 0);
+		while (!nodeStack.empty())
+		{
+			int index = nodeStack.back();
+			nodeStack.pop_back();
+			const BLAS::Node& node = nodes[index];
+			if (!BoxesOverlap(node.boundsMin, node.boundsMax, triMin, triMax))
+				continue;
+
+			bool isAncestor = std::any_of(leaves.begin(), leaves.end(),
+				[&](int leaf) { return enter[index] <= enter[leaf] && exit[leaf] <= exit[index]; });
+			if (!isAncestor)
+			{
+				BoundingBox clippedBounds;
+				float area = 0;
+				if (!ClipTriangle(tri, node.boundsMin, node.boundsMax, &clippedBounds, &area) || area <= 0)
+					continue;
+				overlapCost += area * (node.triangleCount > 0 ? node.triangleCount : 1);
+			}
+			if (node.triangleCount <= 0)
+			{
+				int left, right;
+				BLAS::GetChildren(nodes, index, blas.m_nodeLayout, &left, &right);
+				nodeStack.push_back(left);
+				nodeStack.push_back(right);
+			}
+		}
+	}
+	stats.epo = overlapCost / std::max(totalArea, 1e-20);
+	return stats;
+}
+
+// Quoted with the characters json doesn't allow in a string escaped, like the \ of windows paths
+static void WriteString(std::ostream& out, const std::string& text)
+{
+	out << "\"";
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if ((unsigned char)c < 0x20)
+			out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec << std::setfill(' ');
+		else
+			out << c;
+	}
+	out << "\"";
+}
+
+static void WriteHistogram(std::ostream& out, const std::map<int, int>& histogram)
+{
+	out << "{";
+	for (auto it = histogram.begin(); it != histogram.end(); ++it)
+		out << (it == histogram.begin() ? " " : ", ") << "\"" << it->first << "\": " << it->second;
+	out << " }";
+}
+
+
+
+int main(int argc, char** argv)
+{
+	AnalyzerSettings settings;
+	if (!ParseArguments(argc, argv, &settings))
+	{
+		std::cerr << "Usage: BVHAnalyzer model.OBJ_MODEL [-depth n] [-minleaf n] [-maxleaf n] [-passes n] [-budget x] [-layout name] [-out file.json]\n";
+		std::cerr << "Layouts: Build, BreadthFirst, DepthFirst, LeftChildImplicit, Treelet\n";
+		return 1;
+	}
+
+	// The build logs to std::cout, keep it out of the json
+	std::streambuf* coutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+
+	Model model = LoadModel(settings.modelPath.c_str());
+	if (model.triangles.empty())
+	{
+		std::cout.rdbuf(coutBuffer);
+		std::cerr << "Could not load " << settings.modelPath << "\n";
+		return 1;
+	}
+
+	BLAS blas{ model, settings.maxNodeDepth, settings.minLeafSize, settings.maxLeafSize, settings.splitBudget };
+	if (!blas.m_built)
+	{
+		std::cout.rdbuf(coutBuffer);
+		std::cerr << "Could not build the bvh of " << settings.modelPath << "\n";
+		return 1;
+	}
+	float sahBeforeOptimization = BLAS::SAHCost(blas.m_nodes.nodes, blas.m_nodeLayout);
+	if (settings.treeletPasses > 0)
+		blas.OptimizeTreelets(settings.treeletPasses);
+	blas.Reorder(settings.layout);
+	float sah = BLAS::SAHCost(blas.m_nodes.nodes, blas.m_nodeLayout);
+	TreeStats stats = AnalyzeTree(blas);
+	size_t pairNodeCount = BLAS::ToPairNodes(blas.m_nodes.nodes, blas.m_nodeLayout).size();
+
+	std::cout.rdbuf(coutBuffer);
+
+	std::ofstream outFile;
+	if (!settings.outPath.empty())
+	{
+		outFile.open(settings.outPath);
+		if (!outFile.is_open())
+		{
+			std::cerr << "Could not open " << settings.outPath << "\n";
+			return 1;
+		}
+	}
+	std::ostream& out = settings.outPath.empty() ? std::cout : outFile;
+
+	const BLAS::BuildTimes& times = blas.m_buildTimes;
+	double totalTime = times.bounds + times.presplit + times.build + times.gather + times.optimize + times.reorder;
+	out << std::setprecision(6);
+	out << "{\n";
+	out << "\t\"model\": ";
+	WriteString(out, settings.modelPath);
+	out << ",\n";
+	// As clamped by the build
+	out << "\t\"settings\": { \"maxNodeDepth\": " << blas.m_maxNodeDepth
+		<< ", \"minLeafSize\": " << blas.m_minLeafSize
+		<< ", \"maxLeafSize\": " << blas.m_maxLeafSize
+		<< ", \"treeletPasses\": " << settings.treeletPasses
+		<< ", \"splitBudget\": " << settings.splitBudget
+		<< ", \"layout\": ";
+	WriteString(out, layoutNames[(int)settings.layout]);
+	out << " },\n";
+	out << "\t\"triangles\": " << blas.m_triangleCount << ",\n";
+	out << "\t\"references\": " << blas.m_referenceCount << ",\n";
+	out << "\t\"nodes\": " << blas.m_nodes.nodes.size() << ",\n";
+	out << "\t\"leaves\": " << stats.leafCount << ",\n";
+	out << "\t\"maxDepth\": " << stats.maxDepth << ",\n";
+	out << "\t\"averageLeafDepth\": " << stats.averageLeafDepth << ",\n";
+	out << "\t\"sahCost\": " << sah << ",\n";
+	out << "\t\"sahCostBeforeOptimization\": " << sahBeforeOptimization << ",\n";
+	out << "\t\"epo\": " << stats.epo << ",\n";
+	out << "\t\"childOverlap\": " << stats.childOverlap << ",\n";
+	out << "\t\"memory\": { \"nodeBytes\": " << blas.m_nodes.nodes.size() * sizeof(BLAS::Node)
+		<< ", \"pairNodeBytes\": " << pairNodeCount * sizeof(BLAS::PairNode)
+		<< ", \"triangleBytes\": " << blas.m_orderedTriangles.size() * sizeof(Triangle)
+		<< ", \"referenceBytes\": " << blas.m_references.size() * sizeof(int) << " },\n";
+	out << "\t\"buildTimeMs\": { \"bounds\": " << times.bounds
+		<< ", \"presplit\": " << times.presplit
+		<< ", \"build\": " << times.build
+		<< ", \"gather\": " << times.gather
+		<< ", \"optimize\": " << times.optimize
+		<< ", \"reorder\": " << times.reorder
+		<< ", \"total\": " << totalTime << " },\n";
+	out << "\t\"leafSizeHistogram\": ";
+	WriteHistogram(out, stats.leafSizeHistogram);
+	out << ",\n\t\"leafDepthHistogram\": ";
+	WriteHistogram(out, stats.leafDepthHistogram);
+	out << "\n}\n";
+	return 0;
+}
@@ -0,0 +1,1086 @@
+// Settings, these are the defaults for the options passed to GetComputeProgram()
+#ifndef SUPERSAMPLING_X
+#define SUPERSAMPLING_X 1
+#endif
+#ifndef SUPERSAMPLING_Y
+#define SUPERSAMPLING_Y 1
+#endif
+// Color the models by how many boxes and triangles were tested instead of shading them
+#ifndef RENDER_BOX_AND_TRI_TESTS
+#define RENDER_BOX_AND_TRI_TESTS 0
+#endif
+#ifndef MIRROR_BOUNCES
+#define MIRROR_BOUNCES 3
+#endif
+// Shadow rays that hit something further from the origin than this are not occluded
+#ifndef SHADOW_DISTANCE
+#define SHADOW_DISTANCE 500.0
+#endif
+// Must be more than the deepest bvh, see BLAS::traversalStackSize
+#ifndef BVH_STACK_SIZE
+#define BVH_STACK_SIZE 32
+#endif
+// The left child of a model bvh node directly follows it and startIndex is the right child,
+// see BLAS::NodeLayout. The primitive bvh always keeps its sibling pairs.
+#ifndef BVH_LEFT_CHILD_IMPLICIT
+#define BVH_LEFT_CHILD_IMPLICIT 0
+#endif
+// Visit the children in the order of the ray direction along the split axis of the parent and
+// test the boxes when they are popped, one node fetch per step instead of three
+#ifndef BVH_ORDERED_TRAVERSAL
+#define BVH_ORDERED_TRAVERSAL 0
+#endif
+// node_buffer holds BVHPairNodes, see BLAS::PairNode
+#ifndef BVH_PAIR_NODES
+#define BVH_PAIR_NODES 0
+#endif
+// Leaves index reference_buffer, which holds the triangle of each reference, see BLAS::presplitBudget
+#ifndef BVH_TRIANGLE_REFERENCES
+#define BVH_TRIANGLE_REFERENCES 0
+#endif
+// Triangles and nodes are read from the 16 bit quantized TinyTriangle and TinyBVHNode buffers
+#ifndef COMPACT_DATA
+#define COMPACT_DATA 0
+#endif
+#if COMPACT_DATA && BVH_PAIR_NODES
+#error COMPACT_DATA has no pair node format
+#endif
+
+
+
+const float INFINITY = 1.0 / 0.0;
+const float PI = 3.14159265359;
+const float EPSILON = 0.000001;
+
+
+
+// Written once per frame by UpdateFrameData() in program.cpp, must match FrameData there
+layout(std140, binding = 0) uniform frame_data {
+	mat4 cameraToWorld;
+	vec2 viewportScale;
+	vec2 jitter; // Subpixel offset in pixels
+	int frameIndex;
+};
+
+layout(binding = 0, rgba32f) writeonly uniform image2D gAlbedoSpecular;
+layout(binding = 1, rgba32f) writeonly uniform image2D gPosition;
+layout(binding = 2, rgba32f) writeonly uniform image2D gNormal;
+layout(binding = 3, r32f)    writeonly uniform image2D gDepth;
+
+// Layers of the materials, see InitMaterialData() in buffer.cpp
+layout(binding = 5) uniform sampler2DArray materialTextures;
+
+
+
+struct Ray {
+	vec3 pos;
+	vec3 dir;
+    vec3 invdir;
+	// Cone around the ray for the texture lod, its width at pos and its growth per unit of distance
+	float coneWidth;
+	float coneSpread;
+};
+
+struct RayHit {
+    bool hit;
+	vec3 pos;
+	float dist;
+	vec3 normal;
+	vec4 albedoSpecular;
+	float curvature; // 1 / radius of the surface, widens the cones of mirror rays
+};
+
+struct Sphere {
+	vec3 position;
+	float radius;
+	vec4 albedoSpecular;
+};
+
+// Band around the local z axis seen from the inside, see Ring in buffer.hpp
+struct Ring {
+	mat4 worldToLocalMatrix;
+	mat4 localToWorldMatrix;
+	float innerRadius;
+	float width;
+	float wallHeight;
+	int floorMaterial;
+	vec4 albedoSpecular;
+};
+
+// Placement of a heightfield tile, see TerrainInstance in buffer.hpp
+struct TerrainInstance {
+	mat4 worldToLocalMatrix;
+	mat4 localToWorldMatrix;
+	int triangleOffset;
+	int mipOffset;
+	int cellCount;
+	int mipLevels;
+	float cellSize;
+	float minHeight;
+	float heightScale;
+	int cellSteps;
+};
+
+struct Capsule {
+    vec3 posa;
+    float _padding0;
+    vec3 posb;
+    float radius;
+    vec4 albedoSpecular;
+};
+
+
+
+struct Triangle {
+	vec3 vertA;
+	float materialIndex; // Into material_data
+	vec3 vertB, vertC;
+	vec3 normA, normB, normC;
+};
+
+struct BVHNode {
+	vec3 boundsMin; float _padding0;
+	vec3 boundsMax; float _padding1;
+	// index refers to triangles if is leaf node (triangleCount > 0)
+	// otherwise it is the index of the first child node
+	int startIndex;
+	int triangleCount;
+	int splitAxis; // Left child is on the low side of this axis
+    int _padding3;
+};
+
+// Bounds of both children of a node, a child is a leaf if its count > 0 and its start is
+// then the first triangle, otherwise it is the pair node of the child
+struct BVHPairNode {
+	vec3 leftMin; int leftStart;
+	vec3 leftMax; int leftCount;
+	vec3 rightMin; int rightStart;
+	vec3 rightMax; int rightCount;
+};
+
+#if COMPACT_DATA
+struct TinyTriangle {
+	uint Avx_Avy;
+	uint Bvx_Bvy;
+	uint Cvx_Cvy;
+	uint Avz_Bvz;
+	uint Cvz_Anx_Any;
+	uint Anz_Bnx_Bny_Bnz;
+	uint Cnx_Cny_Cnz;
+	uint materialIndex;
+};
+
+struct TinyBVHNode {
+	uint mix_max;
+	uint miy_may;
+	uint miz_maz;
+	uint startIndex24_triangleCount8;
+};
+#endif
+
+// See Material and MaterialProjection in buffer.hpp
+const int PROJECTION_NONE = 0;
+const int PROJECTION_CYLINDER = 1;
+
+struct Material {
+	vec4 albedoSpecular;
+	mat4 worldToTextureMatrix;
+	int textureLayer;
+	float textureScale;
+	int projection;
+	int _padding0;
+};
+
+struct RayTracingMaterial {
+	vec4 albedoSpecular;
+	int flag;
+};
+
+struct Model {
+	int nodeOffset;
+	int triOffset;
+	int referenceOffset;
+	mat4 worldToLocalMatrix;
+    mat4 localToWorldMatrix;
+	RayTracingMaterial material;
+	// What the compact data is quantized over
+	vec3 boundsMin;
+	vec3 boundsExtent;
+};
+
+// Only what traversal needs to pick the closest hit, the surface attributes
+// are fetched once after traversal is done
+struct TriangleHitInfo {
+	float dist;
+	float u;
+	float v;
+    int triIndex;
+};
+
+struct ModelHitInfo {
+	float dist;
+	float u;
+	float v;
+	int triIndex;
+	int modelIndex;
+};
+
+
+
+layout(binding = 4, std430) readonly buffer sphere_buffer {
+    int sphereCount;
+    Sphere spheres[];
+};
+
+layout(binding = 20, std430) readonly buffer capsule_buffer {
+    int capsuleCount;
+    Capsule capsules[];
+};
+
+// Filled by InitMaterialData() in buffer.cpp, must match Material::maxCount
+const int MAX_MATERIALS = 128;
+layout(std140, binding = 1) uniform material_data {
+    Material materials[MAX_MATERIALS];
+};
+
+layout(binding = 17, std430) readonly buffer ring_buffer {
+    int ringCount;
+    Ring rings[];
+};
+
+layout(binding = 18, std430) readonly buffer terrain_instance_buffer {
+    int terrainInstanceCount;
+    TerrainInstance terrainInstances[];
+};
+layout(binding = 19, std430) readonly buffer terrain_data_buffer {
+    int terrainDataCount;
+    int _terrainPadding0;
+    int _terrainPadding1;
+    int _terrainPadding2;
+    // TerrainTriangle of 8 uints in cell order and then the min | max << 16 mips of each tile
+    uint terrainData[];
+};
+
+layout(binding = 5, std430) readonly buffer model_buffer {
+    int modelCount;
+    Model models[];
+};
+#if COMPACT_DATA
+// The tiny structs only align to 4 bytes, the padding keeps them at offset 16 like the others
+layout(binding = 6, std430) readonly buffer triangle_buffer {
+    int triangleCount;
+    int _trianglePadding0;
+    int _trianglePadding1;
+    int _trianglePadding2;
+    TinyTriangle triangles[];
+};
+layout(binding = 7, std430) readonly buffer node_buffer {
+    int nodesCount;
+    int _nodePadding0;
+    int _nodePadding1;
+    int _nodePadding2;
+    TinyBVHNode nodes[];
+};
+#else
+layout(binding = 6, std430) readonly buffer triangle_buffer {
+    int triangleCount;
+    Triangle triangles[];
+};
+#if BVH_PAIR_NODES
+layout(binding = 7, std430) readonly buffer node_buffer {
+    int nodesCount;
+    BVHPairNode pairNodes[];
+};
+#else
+layout(binding = 7, std430) readonly buffer node_buffer {
+    int nodesCount;
+    BVHNode nodes[];
+};
+#endif
+#endif
+#if BVH_TRIANGLE_REFERENCES
+layout(binding = 16, std430) readonly buffer reference_buffer {
+    int referenceCount;
+    int _referencePadding0;
+    int _referencePadding1;
+    int _referencePadding2;
+    // Triangle of each leaf entry, relative to the triOffset of the model
+    int triangleReferences[];
+};
+#endif
+layout(binding = 8, std430) readonly buffer primitive_buffer {
+    int primitiveCount;
+    int _primitivePadding0;
+    int _primitivePadding1;
+    int _primitivePadding2;
+    // (type << 24 | index) references to the analytic primitives in leaf order
+    int primitives[];
+};
+layout(binding = 9, std430) readonly buffer primitive_node_buffer {
+    int primitiveNodeCount;
+    BVHNode primitiveNodes[];
+};
+
+const int PRIMITIVE_SPHERE = 0;
+const int PRIMITIVE_RING = 1;
+const int PRIMITIVE_TERRAIN = 2;
+const int PRIMITIVE_CAPSULE = 3;
+
+// Width of the cone of the ray where it hits the surface at dist, stretched by the angle of
+// incidence. Only grazing hits are clamped so the far floor does not blur to a single color.
+float cone_footprint(Ray ray, float dist, vec3 normal) {
+	return (ray.coneWidth + ray.coneSpread * dist) / max(abs(dot(ray.dir, normal)), 0.05);
+}
+
+// Surface color and specular of the material at the texture coordinate uv in world units, the
+// texture level is picked so one texel covers the footprint, see cone_footprint()
+vec4 material_albedo_specular(int materialIndex, vec2 uv, float footprint) {
+	Material material = materials[materialIndex];
+	vec4 albedoSpecular = material.albedoSpecular;
+	if (material.textureLayer >= 0) {
+		float texels = footprint * material.textureScale * float(textureSize(materialTextures, 0).x);
+		albedoSpecular.rgb *= textureLod(materialTextures, vec3(uv * material.textureScale, material.textureLayer), log2(max(texels, 1.0))).rgb;
+	}
+	return albedoSpecular;
+}
+
+
+
+#if COMPACT_DATA
+// Positions are stored as 16 bit fractions of the bounds of the blas, normals as 8 bit
+vec3 tiny_position(Model model, uint x, uint y, uint z) {
+	return model.boundsMin + vec3(x, y, z) * (model.boundsExtent / 65535.0);
+}
+
+Triangle get_triangle(Model model, int index) {
+	TinyTriangle tiny = triangles[index];
+	Triangle otri;
+	otri.vertA = tiny_position(model, tiny.Avx_Avy & 0xFFFF, tiny.Avx_Avy >> 16, tiny.Avz_Bvz & 0xFFFF);
+	otri.vertB = tiny_position(model, tiny.Bvx_Bvy & 0xFFFF, tiny.Bvx_Bvy >> 16, tiny.Avz_Bvz >> 16);
+	otri.vertC = tiny_position(model, tiny.Cvx_Cvy & 0xFFFF, tiny.Cvx_Cvy >> 16, tiny.Cvz_Anx_Any & 0xFFFF);
+
+	otri.normA.x = float((tiny.Cvz_Anx_Any & 0x00FF0000) >> 16);
+	otri.normA.y = float((tiny.Cvz_Anx_Any & 0xFF000000) >> 24);
+	otri.normA.z = float((tiny.Anz_Bnx_Bny_Bnz & 0x000000FF) >> 0);
+	otri.normA = otri.normA * (1.0 / 128.0) - 1;
+	otri.normB.x = float((tiny.Anz_Bnx_Bny_Bnz & 0x0000FF00) >> 8);
+	otri.normB.y = float((tiny.Anz_Bnx_Bny_Bnz & 0x00FF0000) >> 16);
+	otri.normB.z = float((tiny.Anz_Bnx_Bny_Bnz & 0xFF000000) >> 24);
+	otri.normB = otri.normB * (1.0 / 128.0) - 1;
+	otri.normC.x = float((tiny.Cnx_Cny_Cnz & 0x000000FF) >> 0);
+	otri.normC.y = float((tiny.Cnx_Cny_Cnz & 0x0000FF00) >> 8);
+	otri.normC.z = float((tiny.Cnx_Cny_Cnz & 0x00FF0000) >> 16);
+	otri.normC = otri.normC * (1.0 / 128.0) - 1;
+	otri.materialIndex = float(tiny.materialIndex);
+	return otri;
+}
+
+BVHNode get_node(Model model, int index) {
+	TinyBVHNode tiny = nodes[index];
+	BVHNode onode;
+	onode.boundsMin = tiny_position(model, tiny.mix_max & 0xFFFF, tiny.miy_may & 0xFFFF, tiny.miz_maz & 0xFFFF);
+	onode.boundsMax = tiny_position(model, tiny.mix_max >> 16, tiny.miy_may >> 16, tiny.miz_maz >> 16);
+	onode.startIndex = int(tiny.startIndex24_triangleCount8 & 0x00FFFFFF);
+	onode.triangleCount = int(tiny.startIndex24_triangleCount8 >> 24);
+	onode.splitAxis = 0; // Not stored, ordered traversal still works but in a worse order
+	return onode;
+}
+#else
+Triangle get_triangle(Model model, int index) {
+	return triangles[index];
+}
+
+#if !BVH_PAIR_NODES
+BVHNode get_node(Model model, int index) {
+	return nodes[index];
+}
+#endif
+#endif
+
+
+
+/*const int triangleCount = 2;
+const Triangle triangles[2] = {
+    { vec3(0, -5, 0), vec3(0, 0, 5), vec3(-5, -5, 0) , vec3(0, 1, 0), vec3(0, 1, 0), vec3(0, 1, 0) },
+    { vec3(0, 0, 0), vec3(0, 0, 5), vec3(5, 0, 0) , vec3(0, 1, 0), vec3(0, 1, 0), vec3(0, 1, 0) },
+};*/
+
+
+
+
+
+
+Ray create_ray(vec3 pos, vec3 dir) {
+    Ray ray;
+    ray.pos = pos;
+    ray.dir = dir;
+    ray.invdir = 1.0 / dir;
+    ray.coneWidth = 0;
+    ray.coneSpread = 0;
+    return ray;
+}
+
+Ray create_camera_ray(vec2 uv) {
+    // Transform the camera origin to world space
+    vec3 pos = (vec4(0.0, 0.0, 0.0, 1.0) * cameraToWorld).xyz;
+
+    // Invert the perspective projection of the view-space position
+    vec3 dir = (vec4(uv * viewportScale, 1.0, 1.0) * cameraToWorld).xyz;
+    dir -= pos;
+    dir = normalize(dir);
+
+    // The cone starts as a point at the camera and covers a pixel
+    Ray ray = create_ray(pos, dir);
+    ray.coneSpread = 2 * viewportScale.y / float(imageSize(gAlbedoSpecular).y);
+    return ray;
+}
+
+RayHit create_ray_hit() {
+    RayHit hit;
+    hit.hit = false;
+    hit.pos = vec3(0);
+    hit.dist = INFINITY;
+    hit.normal = vec3(0);
+    hit.albedoSpecular = vec4(0.0, 0.0, 0.0, 0.0);
+    hit.curvature = 0;
+    return hit;
+}
+
+
+
+void ray_sphere_intersection(Ray ray, inout RayHit bestHit, Sphere sphere) {
+    // Calculate distance along the ray where the sphere is intersected
+    vec3 d = ray.pos - sphere.position;
+    float p1 = -dot(ray.dir, d);
+    float p2sqr = p1 * p1 - dot(d, d) + sphere.radius * sphere.radius;
+    if (p2sqr < 0)
+        return;
+    float p2 = sqrt(p2sqr);
+    float t = p1 - p2 > 0 ? p1 - p2 : p1 + p2;
+    if (t > 0 && t < bestHit.dist) {
+        bestHit.hit = true;
+        bestHit.dist = t;
+        bestHit.pos = ray.pos + t * ray.dir;
+        bestHit.normal = normalize(bestHit.pos - sphere.position);
+        bestHit.albedoSpecular = sphere.albedoSpecular;
+        bestHit.curvature = 1.0 / sphere.radius;
+    }
+}
+
+// Same test as RayRingDist() in buffer.cpp, the floor is textured along the band
+void ray_ring_intersection(Ray ray, inout RayHit bestHit, Ring ring) {
+    vec3 pos = vec3(vec4(ray.pos, 1) * ring.worldToLocalMatrix);
+    vec3 dir = vec3(vec4(ray.dir, 0) * ring.worldToLocalMatrix);
+    float halfWidth = ring.width * 0.5;
+    float dist = bestHit.dist;
+    bool isFloor = false;
+    vec3 normal = vec3(0);
+
+    // Floor, the cylinder x^2 + y^2 = r^2 between the walls
+    float a = dot(dir.xy, dir.xy);
+    float b = dot(pos.xy, dir.xy);
+    float c = dot(pos.xy, pos.xy) - ring.innerRadius * ring.innerRadius;
+    float discriminant = b * b - a * c;
+    if (a > 0 && discriminant >= 0) {
+        // Without the cancellation of -b + sqrt, rays leaving the floor start close to a root
+        float q = -(b + (b >= 0 ? 1 : -1) * sqrt(discriminant));
+        float roots[2] = float[2](q / a, c / q);
+        for (int i = 0; i < 2; i++) {
+            float t = roots[i];
+            if (t > 0 && t < dist && abs(pos.z + dir.z * t) <= halfWidth) {
+                dist = t;
+                isFloor = true;
+            }
+        }
+    }
+
+    // Walls, the annuli in the planes at both edges of the floor
+    float wallTop = ring.innerRadius - ring.wallHeight;
+    for (int side = -1; side <= 1; side += 2) {
+        float t = (float(side) * halfWidth - pos.z) / dir.z;
+        vec2 hit = pos.xy + dir.xy * t;
+        float radiusSquared = dot(hit, hit);
+        if (t > 0 && t < dist && radiusSquared <= ring.innerRadius * ring.innerRadius && radiusSquared >= wallTop * wallTop) {
+            dist = t;
+            isFloor = false;
+            normal = vec3(0, 0, -float(side));
+        }
+    }
+
+    if (dist < bestHit.dist) {
+        vec3 localPos = pos + dir * dist;
+        if (isFloor)
+            normal = vec3(-localPos.xy, 0);
+        // Both sides of the band can be hit
+        normal = faceforward(normal, dir, normal);
+
+        bestHit.hit = true;
+        bestHit.dist = dist;
+        bestHit.pos = ray.pos + dist * ray.dir;
+        bestHit.normal = normalize(vec3(vec4(normal, 0) * ring.localToWorldMatrix));
+        bestHit.albedoSpecular = ring.albedoSpecular;
+        bestHit.curvature = 0;
+        if (isFloor) {
+            vec2 uv = vec2(localPos.z, atan(localPos.y, localPos.x) * ring.innerRadius);
+            bestHit.albedoSpecular = material_albedo_specular(ring.floorMaterial, uv, cone_footprint(ray, dist, bestHit.normal));
+        }
+    }
+}
+
+float ray_capsule_intersection_dist(Ray ray, Capsule capsule)
+{
+    vec3 ba = capsule.posb - capsule.posa;
+    vec3 oa = ray.pos - capsule.posa;
+
+    float baba = dot(ba,ba);
+    float bard = dot(ba,ray.dir);
+    float baoa = dot(ba,oa);
+    float rdoa = dot(ray.dir,oa);
+    float oaoa = dot(oa,oa);
+
+    float a = baba      - bard*bard;
+    float b = baba*rdoa - baoa*bard;
+    float c = baba*oaoa - baoa*baoa - capsule.radius*capsule.radius*baba;
+    float h = b*b - a*c;
+    if (h >= 0.0)
+    {
+        float t = (-b - sqrt(h)) / a;
+        float y = baoa + t * bard;
+        // body
+        if (y > 0.0 && y < baba) return t;
+        // caps
+        vec3 oc = (y <= 0.0) ? oa : ray.pos - capsule.posb;
+        b = dot(ray.dir, oc);
+        c = dot(oc, oc) - capsule.radius * capsule.radius;
+        h = b*b - c;
+        if (h > 0.0) return -b - sqrt(h);
+    }
+    return INFINITY;
+}
+
+// compute normal
+vec3 ray_capsule_intersection_normal(vec3 pos, Capsule capsule)
+{
+    vec3  ba = capsule.posb - capsule.posa;
+    vec3  pa = pos - capsule.posa;
+    float h = clamp(dot(pa,ba)/dot(ba,ba),0.0,1.0);
+    return (pa - h*ba)/capsule.radius;
+}
+
+void ray_capsule_intersection(Ray ray, inout RayHit bestHit, Capsule capsule)
+{
+    // The distance is negative if the capsule is behind the ray or around its start
+    float dist = ray_capsule_intersection_dist(ray, capsule);
+    if (dist > 0 && dist < bestHit.dist) {
+        bestHit.hit = true;
+        bestHit.dist = dist;
+        bestHit.pos = ray.pos + ray.dir * dist;
+        bestHit.normal = ray_capsule_intersection_normal(bestHit.pos, capsule);
+        bestHit.albedoSpecular = capsule.albedoSpecular;
+        bestHit.curvature = 1.0 / capsule.radius;
+    }
+}
+
+/*TriangleHitInfo ray_triangle_intersection2(Ray ray, Triangle tri)
+{
+	vec3 edgeAB = tri.vertB - tri.vertA;
+	vec3 edgeAC = tri.vertC - tri.vertA;
+	vec3 normalVector = cross(edgeAB, edgeAC);
+	vec3 ao = ray.pos - tri.vertA;
+	vec3 dao = cross(ao, ray.dir);
+
+	float det = -dot(ray.dir, normalVector);
+	float invDet = 1.0 / det;
+
+	// Calculate dist to triangle & barycentric coordinates of intersection point
+	float dist = dot(ao, normalVector) * invDet;
+	float u = dot(edgeAC, dao) * invDet;
+	float v = -dot(edgeAB, dao) * invDet;
+	float w = 1 - u - v;
+
+	// Initialize hit info
+	TriangleHitInfo hitInfo;
+	hitInfo.hit = det >= EPSILON && dist >= 0 && u >= 0 && v >= 0 && w >= 0;
+	hitInfo.pos = ray.pos + ray.dir * dist;
+	hitInfo.normal = normalize(tri.normA * w + tri.normB * u + tri.normC * v);
+	hitInfo.dist = dist;
+	return hitInfo;
+}*/
+
+
+TriangleHitInfo ray_triangle_intersection(Ray ray, Triangle tri)
+{
+    TriangleHitInfo hitInfo;
+    hitInfo.dist = INFINITY;
+    hitInfo.u = 0;
+    hitInfo.v = 0;
+    hitInfo.triIndex = -1;
+    
+    vec3 edge1 = tri.vertB - tri.vertA;
+    vec3 edge2 = tri.vertC - tri.vertA;
+    vec3 ray_cross_e2 = cross(ray.dir, edge2);
+    float det = dot(edge1, ray_cross_e2);
+
+    if (det > -EPSILON && det < EPSILON)
+        return hitInfo;    // This ray is parallel to this triangle.
+
+    float inv_det = 1.0 / det;
+    vec3 s = ray.pos - tri.vertA;
+    float u = inv_det * dot(s, ray_cross_e2);
+
+    if (u < 0 || u > 1)
+        return hitInfo;
+
+    vec3 s_cross_e1 = cross(s, edge1);
+    float v = inv_det * dot(ray.dir, s_cross_e1);
+
+    if (v < 0 || u + v > 1)
+        return hitInfo;
+
+    // At this stage we can compute t to find out where the intersection point is on the line.
+    float t = inv_det * dot(edge2, s_cross_e1);
+
+    if (t > EPSILON) // ray intersection
+    {
+	    hitInfo.dist = t;
+        hitInfo.u = u;
+        hitInfo.v = v;
+    }
+    // else there is a line intersection but not a ray intersection.
+    return hitInfo;
+}
+
+// Thanks to https://tavianator.com/2011/ray_box.html
+float ray_boundingbox_dist(Ray ray, vec3 boxMin, vec3 boxMax)
+{
+	vec3 tMin = (boxMin - ray.pos) * ray.invdir;
+	vec3 tMax = (boxMax - ray.pos) * ray.invdir;
+	vec3 t1 = min(tMin, tMax);
+	vec3 t2 = max(tMin, tMax);
+	float tNear = max(max(t1.x, t1.y), t1.z);
+	float tFar = min(min(t2.x, t2.y), t2.z);
+
+	bool hit = tFar >= tNear && tFar > 0;
+	float dist = hit ? tNear > 0 ? tNear : 0 : INFINITY;
+	return dist;
+};
+
+
+
+void ray_leaf_intersection(Ray ray, int start, int count, Model model, inout TriangleHitInfo result, inout ivec2 stats)
+{
+	for (int i = 0; i < count; i++)
+	{
+#if BVH_TRIANGLE_REFERENCES
+		int triIndex = model.triOffset + triangleReferences[model.referenceOffset + start + i];
+#else
+		int triIndex = model.triOffset + start + i;
+#endif
+		Triangle tri = get_triangle(model, triIndex);
+		TriangleHitInfo triHitInfo = ray_triangle_intersection(ray, tri);
+#if RENDER_BOX_AND_TRI_TESTS
+		stats[0]++; // count triangle intersection tests
+#endif
+
+		if (triHitInfo.dist < result.dist)
+		{
+			result = triHitInfo;
+			result.triIndex = triIndex;
+		}
+	}
+}
+
+TriangleHitInfo RayTriangleBVH(Ray ray, float rayLength, Model model, inout ivec2 stats)
+{
+	TriangleHitInfo result;
+	result.dist = rayLength;
+	result.triIndex = -1;
+
+	int nodeOffset = model.nodeOffset;
+	int stack[BVH_STACK_SIZE];
+	int stackIndex = 0;
+	stack[stackIndex++] = nodeOffset + 0;
+
+#if BVH_PAIR_NODES
+	// Leaf children are pushed as ~(pair node << 1 | side) and read from their parent when popped
+	while (stackIndex > 0)
+	{
+		int entry = stack[--stackIndex];
+		if (entry < 0)
+		{
+			int pairIndex = ~entry >> 1;
+			if ((~entry & 1) == 0)
+				ray_leaf_intersection(ray, pairNodes[pairIndex].leftStart, pairNodes[pairIndex].leftCount, model, result, stats);
+			else
+				ray_leaf_intersection(ray, pairNodes[pairIndex].rightStart, pairNodes[pairIndex].rightCount, model, result, stats);
+			continue;
+		}
+
+		BVHPairNode pair = pairNodes[entry];
+		float distA = ray_boundingbox_dist(ray, pair.leftMin, pair.leftMax);
+		float distB = ray_boundingbox_dist(ray, pair.rightMin, pair.rightMax);
+#if RENDER_BOX_AND_TRI_TESTS
+		stats[1] += 2; // count bounding box intersection tests
+#endif
+		int childIndexA = pair.leftCount > 0 ? ~(entry << 1) : nodeOffset + pair.leftStart;
+		int childIndexB = pair.rightCount > 0 ? ~(entry << 1 | 1) : nodeOffset + pair.rightStart;
+
+		// We want to look at closest child node first, so push it last
+		bool isNearestA = distA <= distB;
+		float distNear = isNearestA ? distA : distB;
+		float distFar = isNearestA ? distB : distA;
+		int childIndexNear = isNearestA ? childIndexA : childIndexB;
+		int childIndexFar = isNearestA ? childIndexB : childIndexA;
+
+		if (distFar < result.dist) stack[stackIndex++] = childIndexFar;
+		if (distNear < result.dist) stack[stackIndex++] = childIndexNear;
+	}
+#else
+	while (stackIndex > 0)
+	{
+		int nodeIndex = stack[--stackIndex];
+		BVHNode node = get_node(model, nodeIndex);
+#if BVH_ORDERED_TRAVERSAL
+		// The box is only tested now, the parent did not look at it
+#if RENDER_BOX_AND_TRI_TESTS
+		stats[1]++; // count bounding box intersection tests
+#endif
+		if (ray_boundingbox_dist(ray, node.boundsMin, node.boundsMax) >= result.dist)
+			continue;
+#endif
+		bool isLeaf = node.triangleCount > 0;
+
+		if (isLeaf)
+		{
+			ray_leaf_intersection(ray, node.startIndex, node.triangleCount, model, result, stats);
+		}
+		else
+		{
+#if BVH_LEFT_CHILD_IMPLICIT
+			int childIndexA = nodeIndex + 1;
+			int childIndexB = nodeOffset + node.startIndex;
+#else
+			int childIndexA = nodeOffset + node.startIndex + 0;
+			int childIndexB = nodeOffset + node.startIndex + 1;
+#endif
+#if BVH_ORDERED_TRAVERSAL
+			// The left child is on the low side of the split, rays going up the axis see it first
+			bool isNearestA = ray.dir[node.splitAxis] >= 0;
+			stack[stackIndex++] = isNearestA ? childIndexB : childIndexA;
+			stack[stackIndex++] = isNearestA ? childIndexA : childIndexB;
+#else
+			BVHNode childA = get_node(model, childIndexA);
+			BVHNode childB = get_node(model, childIndexB);
+
+			float distA = ray_boundingbox_dist(ray, childA.boundsMin, childA.boundsMax);
+			float distB = ray_boundingbox_dist(ray, childB.boundsMin, childB.boundsMax);
+#if RENDER_BOX_AND_TRI_TESTS
+			stats[1] += 2; // count bounding box intersection tests
+#endif
+						
+			// We want to look at closest child node first, so push it last
+			bool isNearestA = distA <= distB;
+			float distNear = isNearestA ? distA : distB;
+			float distFar = isNearestA ? distB : distA;
+			int childIndexNear = isNearestA ? childIndexA : childIndexB;
+			int childIndexFar = isNearestA ? childIndexB : childIndexA;
+
+			if (distFar < result.dist) stack[stackIndex++] = childIndexFar;
+			if (distNear < result.dist) stack[stackIndex++] = childIndexNear;
+#endif
+		}
+	}
+#endif
+
+	return result;
+}
+
+// Decodes the TerrainTriangle at index of the tile into its local space
+Triangle get_terrain_triangle(TerrainInstance terrain, int index) {
+	int start = terrain.triangleOffset + index * 8;
+	uint Ax_Ay = terrainData[start + 0];
+	uint Bx_By = terrainData[start + 1];
+	uint Cx_Cy = terrainData[start + 2];
+	uint Az_Bz = terrainData[start + 3];
+	uint Cz_Anx_Any = terrainData[start + 4];
+	uint Anz_Bnx_Bny_Bnz = terrainData[start + 5];
+	uint Cnx_Cny_Cnz_id1 = terrainData[start + 6];
+
+	float positionScale = terrain.cellSize / float(terrain.cellSteps);
+	Triangle tri;
+	tri.vertA = vec3(vec2(Ax_Ay & 0xFFFF, Ax_Ay >> 16) * positionScale, terrain.minHeight + float(Az_Bz & 0xFFFF) * terrain.heightScale);
+	tri.vertB = vec3(vec2(Bx_By & 0xFFFF, Bx_By >> 16) * positionScale, terrain.minHeight + float(Az_Bz >> 16) * terrain.heightScale);
+	tri.vertC = vec3(vec2(Cx_Cy & 0xFFFF, Cx_Cy >> 16) * positionScale, terrain.minHeight + float(Cz_Anx_Any & 0xFFFF) * terrain.heightScale);
+	tri.normA = vec3((Cz_Anx_Any >> 16) & 0xFF, Cz_Anx_Any >> 24, Anz_Bnx_Bny_Bnz & 0xFF) / 128.0 - 1.0;
+	tri.normB = vec3((Anz_Bnx_Bny_Bnz >> 8) & 0xFF, (Anz_Bnx_Bny_Bnz >> 16) & 0xFF, Anz_Bnx_Bny_Bnz >> 24) / 128.0 - 1.0;
+	tri.normC = vec3(Cnx_Cny_Cnz_id1 & 0xFF, (Cnx_Cny_Cnz_id1 >> 8) & 0xFF, (Cnx_Cny_Cnz_id1 >> 16) & 0xFF) / 128.0 - 1.0;
+	return tri;
+}
+
+// Walks the min max mips of the tile from the top, descending into the blocks whose height
+// range the ray overlaps and stepping to the next block otherwise. Same traversal as
+// RayTerrainDist() in terrain.cpp.
+void ray_terrain_intersection(Ray ray, inout RayHit bestHit, TerrainInstance terrain) {
+    Ray localRay = create_ray(vec3(vec4(ray.pos, 1) * terrain.worldToLocalMatrix), vec3(vec4(ray.dir, 0) * terrain.worldToLocalMatrix));
+    vec3 pos = localRay.pos;
+    vec3 dir = localRay.dir;
+
+    float size = float(terrain.cellCount) * terrain.cellSize;
+    float maxHeight = terrain.minHeight + 65535.0 * terrain.heightScale;
+    vec3 invDir = 1.0 / dir;
+    vec3 t1 = (vec3(0, 0, terrain.minHeight) - pos) * invDir;
+    vec3 t2 = (vec3(size, size, maxHeight) - pos) * invDir;
+    vec3 tMin = min(t1, t2);
+    vec3 tMax = max(t1, t2);
+    float t = max(max(max(tMin.x, tMin.y), tMin.z), 0);
+    float tFar = min(min(min(tMax.x, tMax.y), tMax.z), bestHit.dist);
+    if (t > tFar)
+        return;
+
+    int level = terrain.mipLevels - 1;
+    // Points on a block boundary belong to the block the ray enters
+    vec2 nudge = sign(dir.xy) * terrain.cellSize * 0.001;
+    int maxSteps = 4 * terrain.cellCount + 2 * terrain.mipLevels + 8;
+
+    for (int step = 0; step < maxSteps; step++) {
+        int blocks = terrain.cellCount >> level;
+        float blockSize = terrain.cellSize * float(1 << level);
+        ivec2 block = clamp(ivec2(floor((pos.xy + dir.xy * t + nudge) / blockSize)), ivec2(0), ivec2(blocks - 1));
+
+        float tExit = tFar;
+        if (dir.x != 0)
+            tExit = min(tExit, ((float(block.x) + (dir.x > 0 ? 1 : 0)) * blockSize - pos.x) * invDir.x);
+        if (dir.y != 0)
+            tExit = min(tExit, ((float(block.y) + (dir.y > 0 ? 1 : 0)) * blockSize - pos.y) * invDir.y);
+
+        uint minMax = terrainData[terrain.mipOffset + (4 * (terrain.cellCount * terrain.cellCount - blocks * blocks)) / 3 + block.y * blocks + block.x];
+        float blockMin = terrain.minHeight + float(minMax & 0xFFFF) * terrain.heightScale;
+        float blockMax = terrain.minHeight + float(minMax >> 16) * terrain.heightScale;
+        float enterHeight = pos.z + dir.z * t;
+        float exitHeight = pos.z + dir.z * tExit;
+        if (min(enterHeight, exitHeight) <= blockMax && max(enterHeight, exitHeight) >= blockMin) {
+            if (level > 0) {
+                level--;
+                continue;
+            }
+            // The triangles lie inside the cell so the first cell with a hit has the closest one
+            int cell = (block.y * terrain.cellCount + block.x) * 2;
+            Triangle tri = get_terrain_triangle(terrain, cell);
+            TriangleHitInfo triHit = ray_triangle_intersection(localRay, tri);
+            Triangle secondTri = get_terrain_triangle(terrain, cell + 1);
+            TriangleHitInfo secondHit = ray_triangle_intersection(localRay, secondTri);
+            if (secondHit.dist < triHit.dist) {
+                tri = secondTri;
+                triHit = secondHit;
+                cell++;
+            }
+            if (triHit.dist < bestHit.dist) {
+                float w = 1.0 - triHit.u - triHit.v;
+                vec3 normal = tri.normA * w + tri.normB * triHit.u + tri.normC * triHit.v;
+                int id1 = int(terrainData[terrain.triangleOffset + cell * 8 + 6] >> 24);
+                uint At_Bt_Ct_id2 = terrainData[terrain.triangleOffset + cell * 8 + 7];
+                int id2 = int(At_Bt_Ct_id2 >> 24);
+                float weight = dot(vec3(At_Bt_Ct_id2 & 0xFF, (At_Bt_Ct_id2 >> 8) & 0xFF, (At_Bt_Ct_id2 >> 16) & 0xFF), vec3(w, triHit.u, triHit.v)) / 255.0;
+
+                bestHit.hit = true;
+                bestHit.dist = triHit.dist;
+                bestHit.pos = ray.pos + triHit.dist * ray.dir;
+                bestHit.normal = normalize(vec3(vec4(normal, 0) * terrain.localToWorldMatrix));
+                bestHit.curvature = 0;
+
+                vec2 uv = (pos + dir * triHit.dist).xy;
+                float footprint = cone_footprint(ray, triHit.dist, bestHit.normal);
+                bestHit.albedoSpecular = mix(material_albedo_specular(id1, uv, footprint), material_albedo_specular(id2, uv, footprint), weight);
+                return;
+            }
+        }
+
+        if (tExit >= tFar)
+            break;
+        t = tExit;
+        level = min(level + 1, terrain.mipLevels - 1);
+    }
+}
+
+void RayPrimitiveBVH(Ray ray, inout RayHit bestHit)
+{
+	if (primitiveCount == 0)
+		return;
+
+	int stack[BVH_STACK_SIZE];
+	int stackIndex = 0;
+	stack[stackIndex++] = 0;
+
+	while (stackIndex > 0)
+	{
+		BVHNode node = primitiveNodes[stack[--stackIndex]];
+		bool isLeaf = node.triangleCount > 0;
+
+		if (isLeaf)
+		{
+			for (int i = 0; i < node.triangleCount; i++)
+			{
+				int primitive = primitives[node.startIndex + i];
+				int type = primitive >> 24;
+				int index = primitive & 0x00FFFFFF;
+				if (type == PRIMITIVE_SPHERE)
+					ray_sphere_intersection(ray, bestHit, spheres[index]);
+				else if (type == PRIMITIVE_RING)
+					ray_ring_intersection(ray, bestHit, rings[index]);
+				else if (type == PRIMITIVE_TERRAIN)
+					ray_terrain_intersection(ray, bestHit, terrainInstances[index]);
+				else if (type == PRIMITIVE_CAPSULE)
+					ray_capsule_intersection(ray, bestHit, capsules[index]);
+			}
+		}
+		else
+		{
+			int childIndexA = node.startIndex + 0;
+			int childIndexB = node.startIndex + 1;
+			BVHNode childA = primitiveNodes[childIndexA];
+			BVHNode childB = primitiveNodes[childIndexB];
+
+			float distA = ray_boundingbox_dist(ray, childA.boundsMin, childA.boundsMax);
+			float distB = ray_boundingbox_dist(ray, childB.boundsMin, childB.boundsMax);
+
+			// We want to look at closest child node first, so push it last
+			bool isNearestA = distA <= distB;
+			float distNear = isNearestA ? distA : distB;
+			float distFar = isNearestA ? distB : distA;
+			int childIndexNear = isNearestA ? childIndexA : childIndexB;
+			int childIndexFar = isNearestA ? childIndexB : childIndexA;
+
+			if (distFar < bestHit.dist) stack[stackIndex++] = childIndexFar;
+			if (distNear < bestHit.dist) stack[stackIndex++] = childIndexNear;
+		}
+	}
+}
+
+ModelHitInfo CalculateRayCollision(Ray worldRay, float rayLength, inout ivec2 stats)
+{
+	ModelHitInfo result;
+	result.dist = rayLength;
+	result.triIndex = -1;
+	result.modelIndex = -1;
+	Ray localRay;
+
+	for (int i = 0; i < modelCount; i++)
+	{
+		Model model = models[i];
+		// Transform ray into model's local coordinate space
+		localRay.pos = vec3(vec4(worldRay.pos, 1) * model.worldToLocalMatrix);
+		localRay.dir = vec3(vec4(worldRay.dir, 0) * model.worldToLocalMatrix);
+		localRay.invdir = 1.0 / localRay.dir;
+
+		// Traverse bvh to find closest triangle intersection with current model
+		TriangleHitInfo hit = RayTriangleBVH(localRay, result.dist, model, stats);
+
+		// Record closest hit, attributes are resolved later in ResolveModelHit()
+		if (hit.triIndex >= 0)
+		{
+			result.dist = hit.dist;
+			result.u = hit.u;
+			result.v = hit.v;
+			result.triIndex = hit.triIndex;
+			result.modelIndex = i;
+		}
+	}
+
+	//result.hit = true;
+	//result.dist = 20;
+	//result.material.albedoSpecular = vec4(0, 1, 0, 1);
+
+	return result;
+}
+
+// Fetch the surface attributes of the closest model hit, done once per ray after traversal
+void ResolveModelHit(Ray worldRay, ModelHitInfo modelHit, inout RayHit bestHit)
+{
+	Model model = models[modelHit.modelIndex];
+	Triangle tri = get_triangle(model, modelHit.triIndex);
+	float w = 1 - modelHit.u - modelHit.v;
+	vec3 localNormal = tri.normA * w + tri.normB * modelHit.u + tri.normC * modelHit.v;
+
+	bestHit.hit = true;
+	bestHit.dist = modelHit.dist;
+	bestHit.pos = worldRay.pos + worldRay.dir * modelHit.dist;
+	bestHit.normal = normalize(vec3(vec4(localNormal, 0) * model.localToWorldMatrix));
+	bestHit.curvature = 0;
+
+	// The meshes have no texture coordinates, their material projects the hit position instead
+	int materialIndex = int(tri.materialIndex);
+	Material material = materials[materialIndex];
+	bestHit.albedoSpecular = material.albedoSpecular;
+	if (material.projection == PROJECTION_CYLINDER) {
+		vec3 texturePos = vec3(vec4(bestHit.pos, 1) * material.worldToTextureMatrix);
+		vec2 uv = vec2(texturePos.z, atan(texturePos.y, texturePos.x) * length(texturePos.xy));
+		bestHit.albedoSpecular = material_albedo_specular(materialIndex, uv, cone_footprint(worldRay, bestHit.dist, bestHit.normal));
+	}
+}
+
+
+
+
+RayHit traceGeometry(Ray ray) {
+    RayHit bestHit = create_ray_hit();
+    //IntersectGroundPlane(ray, bestHit);
+
+    RayPrimitiveBVH(ray, bestHit);
+
+	ivec2 stats = ivec2(0);
+	ModelHitInfo modelHit = CalculateRayCollision(ray, bestHit.dist, stats);
+	if (modelHit.triIndex >= 0) {
+		ResolveModelHit(ray, modelHit, bestHit);
+
+#if RENDER_BOX_AND_TRI_TESTS
+		{
+			const int boxMax = 200;
+			const int triMax = 20;
+			bestHit.albedoSpecular = vec4(float(stats.x) / triMax, 0, float(stats.y) / boxMax, 1);
+			if (stats.x > triMax) bestHit.albedoSpecular = vec4(1, 0.75, 0.75, 1);
+			if (stats.y > boxMax) bestHit.albedoSpecular = vec4(0.75, 0.75, 1, 1);
+			if (stats.y > boxMax && stats.x > triMax) bestHit.albedoSpecular = vec4(0.25, 0, 0, 1);
+			bestHit.hit = true;
+			bestHit.normal = vec3(0, 0, 0);
+		}
+#endif
+	}
+
+    return bestHit;
+}
+
+RayHit trace(Ray ray) {
+	RayHit hit = traceGeometry(ray);
+	return hit;
+}
+
+
+
+const vec3 directionalLight = normalize(vec3(-0.5, -1, -1));
+
+// Secondary rays and lighting, shared by the megakernel in comp.glsl and the wavefront kernels
+Ray create_mirror_ray(Ray ray, RayHit hit) {
+	Ray mirrorRay = create_ray(hit.pos, reflect(ray.dir, hit.normal));
+	mirrorRay.pos += hit.normal * 0.01;
+	// A curved mirror spreads the reflected directions by twice the turn of its normal across the cone
+	mirrorRay.coneWidth = ray.coneWidth + ray.coneSpread * hit.dist;
+	mirrorRay.coneSpread = ray.coneSpread + 2 * mirrorRay.coneWidth * hit.curvature;
+	return mirrorRay;
+}
+
+Ray create_shadow_ray(RayHit hit) {
+	Ray shadowRay = create_ray(hit.pos, -normalize(hit.pos));
+	shadowRay.pos += hit.normal * 0.005;
+	return shadowRay;
+}
+
+float shadow_light(RayHit hit, RayHit shadowHit) {
+	float light = 1.0;
+	if (!shadowHit.hit || length(shadowHit.pos) > SHADOW_DISTANCE) {
+		light = 0.5;
+	} else {
+		// hit.albedoSpecular.rgb *= dot(hit.normal, normalize(hit.pos));
+	}
+	light *= dot(hit.normal, -normalize(hit.pos));
+	return max(light, 0.25);
+}
@@ -0,0 +1,82 @@
+// Ray queues shared by the wavefront kernels, see wavefront.cpp for how they are dispatched
+
+
+
+struct QueuedRay {
+	vec3 pos;
+	int pixel;
+	vec3 dir;
+	int bounce;
+	vec4 color; // Product of the albedos of the mirrors hit so far
+	float coneWidth;
+	float coneSpread;
+	float _padding0;
+	float _padding1;
+};
+
+struct QueuedHit {
+	vec3 pos;
+	float dist;
+	vec3 normal;
+	int hit;
+	vec4 albedoSpecular;
+	float curvature;
+	float _padding0;
+	float _padding1;
+	float _padding2;
+};
+
+struct ShadowRay {
+	vec3 pos;
+	int pixel;
+	vec3 normal;
+	float dist;
+	vec4 albedoSpecular;
+};
+
+
+
+layout(binding = 10, std430) buffer wavefront_counters {
+	uint rayCount;       // Rays in ray_queue_in
+	uint nextRayCount;   // Rays pushed to ray_queue_out by the shade kernel
+	uint shadowRayCount; // Rays pushed to shadow_queue by the shade kernel
+	uint _counterPadding;
+	uvec4 extendDispatch; // Indirect dispatch arguments for the extend and shade kernels
+	uvec4 shadowDispatch; // Indirect dispatch arguments for the shadow kernel
+};
+layout(binding = 11, std430) buffer ray_queue_in {
+	QueuedRay queuedRays[];
+};
+layout(binding = 12, std430) buffer ray_queue_out {
+	QueuedRay nextQueuedRays[];
+};
+layout(binding = 13, std430) buffer hit_queue {
+	QueuedHit queuedHits[];
+};
+layout(binding = 14, std430) buffer shadow_queue {
+	ShadowRay shadowRays[];
+};
+
+const int wavefrontGroupSize = 64;
+
+
+
+Ray queued_ray(QueuedRay queued) {
+	Ray ray = create_ray(queued.pos, queued.dir);
+	ray.coneWidth = queued.coneWidth;
+	ray.coneSpread = queued.coneSpread;
+	return ray;
+}
+
+ivec2 pixel_coord(int pixel) {
+	int width = imageSize(gAlbedoSpecular).x;
+	return ivec2(pixel % width, pixel / width);
+}
+
+void store_gbuffer(int pixel, RayHit hit) {
+	ivec2 texelCoord = pixel_coord(pixel);
+	imageStore(gAlbedoSpecular, texelCoord, hit.albedoSpecular);
+	imageStore(gPosition, texelCoord, vec4(hit.pos, 0));
+	imageStore(gNormal, texelCoord, vec4(hit.normal, 0));
+	imageStore(gDepth, texelCoord, vec4(hit.dist, 0, 0, 0));
+}
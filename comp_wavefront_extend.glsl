@@ -0,0 +1,26 @@
+#version 460 core
+
+#include "comp_common.glsl"
+#include "comp_wavefront.glsl"
+
+
+
+// Finds the closest hit of every ray in ray_queue_in
+layout (local_size_x = wavefrontGroupSize, local_size_y = 1, local_size_z = 1) in;
+void main() {
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= rayCount)
+		return;
+
+	QueuedRay queued = queuedRays[index];
+	RayHit hit = traceGeometry(queued_ray(queued));
+
+	QueuedHit queuedHit;
+	queuedHit.pos = hit.pos;
+	queuedHit.dist = hit.dist;
+	queuedHit.normal = hit.normal;
+	queuedHit.hit = hit.hit ? 1 : 0;
+	queuedHit.albedoSpecular = hit.albedoSpecular;
+	queuedHit.curvature = hit.curvature;
+	queuedHits[index] = queuedHit;
+}
@@ -0,0 +1,29 @@
+#version 460 core
+
+#include "comp_common.glsl"
+#include "comp_wavefront.glsl"
+
+
+
+// Writes one camera ray per pixel into ray_queue_in
+layout (local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+void main() {
+	ivec2 texelCoord = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 size = imageSize(gAlbedoSpecular);
+	if (texelCoord.x >= size.x || texelCoord.y >= size.y)
+		return;
+
+	vec2 uv = vec2(texelCoord) / vec2(size) * 2 - 1;
+	Ray ray = create_camera_ray(uv);
+
+	int pixel = texelCoord.y * size.x + texelCoord.x;
+	QueuedRay queued;
+	queued.pos = ray.pos;
+	queued.pixel = pixel;
+	queued.dir = ray.dir;
+	queued.bounce = 0;
+	queued.color = vec4(1);
+	queued.coneWidth = ray.coneWidth;
+	queued.coneSpread = ray.coneSpread;
+	queuedRays[pixel] = queued;
+}
@@ -0,0 +1,16 @@
+#version 460 core
+
+#include "comp_common.glsl"
+#include "comp_wavefront.glsl"
+
+
+
+// Runs as a single invocation between bounces, makes the rays pushed by the
+// shade kernel the input of the next bounce and sets up the indirect dispatches
+layout (local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+void main() {
+	rayCount = nextRayCount;
+	nextRayCount = 0;
+	extendDispatch = uvec4((rayCount + wavefrontGroupSize - 1) / wavefrontGroupSize, 1, 1, 0);
+	shadowDispatch = uvec4((shadowRayCount + wavefrontGroupSize - 1) / wavefrontGroupSize, 1, 1, 0);
+}
@@ -0,0 +1,52 @@
+#version 460 core
+
+#include "comp_common.glsl"
+#include "comp_wavefront.glsl"
+
+
+
+// Turns every hit into either a mirror ray in ray_queue_out, a shadow ray in
+// shadow_queue, or a finished pixel if the ray missed everything
+layout (local_size_x = wavefrontGroupSize, local_size_y = 1, local_size_z = 1) in;
+void main() {
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= rayCount)
+		return;
+
+	QueuedRay queued = queuedRays[index];
+	QueuedHit queuedHit = queuedHits[index];
+
+	RayHit hit = create_ray_hit();
+	if (queuedHit.hit == 0) {
+		hit.dist = queuedHit.dist;
+		store_gbuffer(queued.pixel, hit);
+		return;
+	}
+	hit.hit = true;
+	hit.pos = queuedHit.pos;
+	hit.dist = queuedHit.dist;
+	hit.normal = queuedHit.normal;
+	hit.curvature = queuedHit.curvature;
+	hit.albedoSpecular = vec4(queued.color.rgb * queuedHit.albedoSpecular.rgb, queuedHit.albedoSpecular.w);
+
+	if (hit.albedoSpecular.w >= 0.5 && queued.bounce < MIRROR_BOUNCES) {
+		Ray ray = create_mirror_ray(queued_ray(queued), hit);
+		QueuedRay mirror;
+		mirror.pos = ray.pos;
+		mirror.pixel = queued.pixel;
+		mirror.dir = ray.dir;
+		mirror.bounce = queued.bounce + 1;
+		mirror.color = vec4(hit.albedoSpecular.rgb, 0);
+		mirror.coneWidth = ray.coneWidth;
+		mirror.coneSpread = ray.coneSpread;
+		nextQueuedRays[atomicAdd(nextRayCount, 1)] = mirror;
+	} else {
+		ShadowRay shadow;
+		shadow.pos = hit.pos;
+		shadow.pixel = queued.pixel;
+		shadow.normal = hit.normal;
+		shadow.dist = hit.dist;
+		shadow.albedoSpecular = hit.albedoSpecular;
+		shadowRays[atomicAdd(shadowRayCount, 1)] = shadow;
+	}
+}
@@ -0,0 +1,26 @@
+#version 460 core
+
+#include "comp_common.glsl"
+#include "comp_wavefront.glsl"
+
+
+
+// Traces the shadow ray of every finished path and writes the pixel to the G-buffer
+layout (local_size_x = wavefrontGroupSize, local_size_y = 1, local_size_z = 1) in;
+void main() {
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= shadowRayCount)
+		return;
+
+	ShadowRay shadow = shadowRays[index];
+	RayHit hit = create_ray_hit();
+	hit.hit = true;
+	hit.pos = shadow.pos;
+	hit.dist = shadow.dist;
+	hit.normal = shadow.normal;
+	hit.albedoSpecular = shadow.albedoSpecular;
+
+	RayHit shadowHit = traceGeometry(create_shadow_ray(hit));
+	hit.albedoSpecular.rgb *= shadow_light(hit, shadowHit);
+	store_gbuffer(shadow.pixel, hit);
+}
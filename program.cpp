@@ -3,12 +3,16 @@
 #include <iostream>
 #include <iomanip>
 #include <vector>
+#include <algorithm>
+#include <string.h>
 #define _USE_MATH_DEFINES
 #include <math.h>
 
 #include "utility.hpp"
 #include "input.hpp"
 #include "buffer.hpp"
+#include "wavefront.hpp"
+#include "bvh.hpp"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stbi_image.h"
@@ -21,6 +25,46 @@ GLuint rayTraceProgram = -1;
 int renderWidth = 640 / 2;
 int renderHeight = 360 / 2;
 
+// Use the separate wavefront kernels instead of the comp.glsl megakernel
+#define WAVEFRONT false
+// Launch a fixed number of comp.glsl workgroups that fetch tiles from a counter
+// instead of one workgroup per tile
+#define PERSISTENT_THREADS false
+// Compare the BLAS::NodeLayout options on the cpu and gpu at startup
+#define BENCHMARK_NODE_LAYOUTS false
+// Upload the trees as built and compare them with their treelet optimized versions at startup
+#define BENCHMARK_TREELET_OPTIMIZATION false
+// Both benchmarks read the full format back from the buffers
+static_assert(!((BENCHMARK_NODE_LAYOUTS || BENCHMARK_TREELET_OPTIMIZATION) && BLAS::uploadCompactData), "The benchmarks need BLAS::uploadCompactData off");
+
+#ifndef GL_SM_COUNT_NV
+#define GL_SM_COUNT_NV 0x933B
+#endif
+
+GLuint tileCounterBuffer = 0;
+int multiprocessorCount = 32;
+const int threadsPerMultiprocessor = 2048;
+
+// Workgroup size of comp.glsl, picked by AutoTuneTileSize()
+int tileSizeX = 32;
+int tileSizeY = 30;
+
+// Compile time settings of the ray tracing shaders, see the defaults in comp_common.glsl
+const ShaderOptions rayTraceOptions = {
+	{ "SUPERSAMPLING_X", "1" },
+	{ "SUPERSAMPLING_Y", "1" },
+	{ "RENDER_BOX_AND_TRI_TESTS", "0" },
+	{ "MIRROR_BOUNCES", "3" },
+	{ "SHADOW_DISTANCE", "500.0" },
+	{ "COMPACT_DATA", BLAS::uploadCompactData ? "1" : "0" },
+	{ "BVH_STACK_SIZE", std::to_string(BLAS::traversalStackSize) },
+	{ "BVH_LEFT_CHILD_IMPLICIT", BLAS::uploadLayout == BLAS::NodeLayout::LeftChildImplicit ? "1" : "0" },
+	{ "BVH_PAIR_NODES", BLAS::uploadPairNodes ? "1" : "0" },
+	{ "BVH_ORDERED_TRAVERSAL", "0" },
+	{ "BVH_TRIANGLE_REFERENCES", BLAS::presplitBudget > 0 ? "1" : "0" },
+	{ "PERSISTENT_THREADS", PERSISTENT_THREADS ? "1" : "0" },
+};
+
 
 
 #define TexParameter \
@@ -36,7 +80,8 @@ int renderHeight = 360 / 2;
 	glBindTexture(GL_TEXTURE_2D, name);                                                               \
 	TexParameter;                                                                                     \
 	glTexImage2D(GL_TEXTURE_2D, 0, internalformat, renderWidth, renderHeight, 0, format, type, NULL); \
-	glBindImageTexture(unit, name, 0, GL_FALSE, 0, GL_WRITE_ONLY, internalformat)
+	glBindImageTexture(unit, name, 0, GL_FALSE, 0, GL_WRITE_ONLY, internalformat);                    \
+	RegisterTexture(#name, name)
 
 
 
@@ -114,24 +159,395 @@ Camera g_camera{};
 
 
 
+// std140 layout of the frame_data uniform block in comp_common.glsl
+struct FrameData
+{
+	glm::mat4 cameraToWorld;
+	glm::vec2 viewportScale;
+	glm::vec2 jitter;
+	int frameIndex;
+	int _padding[3];
+};
+
+DynamicBuffer frameDataBuffer;
+
+// All per frame shader parameters go through here in a single buffer write
+void UpdateFrameData(int frameIndex)
+{
+	FrameData frameData;
+	frameData.cameraToWorld = g_camera.GetViewMatrix();
+	frameData.viewportScale = g_camera.GetViewportScale();
+	frameData.jitter = glm::vec2(0); // Nothing accumulates over frames yet
+	frameData.frameIndex = frameIndex;
+	memcpy(frameDataBuffer.Map(), &frameData, sizeof(FrameData));
+}
+
+
+
+GLuint CreateRayTraceProgram(int tileX, int tileY, ShaderOptions options = rayTraceOptions)
+{
+	options["TILE_SIZE_X"] = std::to_string(tileX);
+	options["TILE_SIZE_Y"] = std::to_string(tileY);
+	return GetComputeProgram("comp.glsl", options);
+}
+
+// Dispatches comp.glsl with the current tile size, the program must already be in use
+void DispatchRayTrace()
+{
+	if (PERSISTENT_THREADS)
+	{
+		GLuint firstTile = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileCounterBuffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &firstTile);
+		int groupsPerMultiprocessor = std::max(1, threadsPerMultiprocessor / (tileSizeX * tileSizeY));
+		glDispatchCompute(multiprocessorCount * groupsPerMultiprocessor, 1, 1);
+	}
+	else
+	{
+		glDispatchCompute((renderWidth + tileSizeX - 1) / tileSizeX, (renderHeight + tileSizeY - 1) / tileSizeY, 1);
+	}
+}
+
+// Times comp.glsl with a few workgroup shapes on the current scene and picks the fastest.
+// The winner is cached per device in tilesize.cache so this only runs on the first start.
+void AutoTuneTileSize()
+{
+	std::string device =
+		std::string((const char*)glGetString(GL_VENDOR)) + " " +
+		std::string((const char*)glGetString(GL_RENDERER)) + " " +
+		std::string((const char*)glGetString(GL_VERSION));
+
+	std::ifstream cacheFile("tilesize.cache");
+	int cachedX = 0;
+	int cachedY = 0;
+	std::string cachedDevice;
+	while (cacheFile >> cachedX >> cachedY && std::getline(cacheFile, cachedDevice))
+	{
+		if (cachedDevice == " " + device)
+		{
+			tileSizeX = cachedX;
+			tileSizeY = cachedY;
+			std::cout << "Cached tile size = " << tileSizeX << "x" << tileSizeY << "\n";
+			return;
+		}
+	}
+	cacheFile.close();
+
+	const int candidates[][2] = {
+		{ 8, 8 }, { 16, 8 }, { 8, 16 }, { 16, 16 }, { 32, 4 }, { 32, 8 }, { 64, 1 }, { 64, 4 }, { 32, 30 },
+	};
+	const int warmupFrames = 2;
+	const int timedFrames = 5;
+
+	int maxInvocations = 0;
+	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+
+	GLuint query;
+	glGenQueries(1, &query);
+	int bestX = tileSizeX;
+	int bestY = tileSizeY;
+	double bestTime = INFINITY;
+	for (const auto& candidate : candidates)
+	{
+		if (candidate[0] * candidate[1] > maxInvocations)
+			continue;
+
+		glUseProgram(CreateRayTraceProgram(candidate[0], candidate[1]));
+		tileSizeX = candidate[0];
+		tileSizeY = candidate[1];
+
+		GLuint64 totalTime = 0;
+		for (int frame = 0; frame < warmupFrames + timedFrames; frame++)
+		{
+			glBeginQuery(GL_TIME_ELAPSED, query);
+			DispatchRayTrace();
+			glEndQuery(GL_TIME_ELAPSED);
+			GLuint64 time = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &time);
+			if (frame >= warmupFrames)
+				totalTime += time;
+		}
+
+		double time = (double)totalTime / timedFrames / 1000000.0;
+		std::cout << "Tile size " << candidate[0] << "x" << candidate[1] << " = " << time << "ms\n";
+		if (time < bestTime)
+		{
+			bestTime = time;
+			bestX = candidate[0];
+			bestY = candidate[1];
+		}
+	}
+	glDeleteQueries(1, &query);
+
+	tileSizeX = bestX;
+	tileSizeY = bestY;
+	std::cout << "Best tile size = " << tileSizeX << "x" << tileSizeY << "\n";
+
+	std::ofstream cacheOut("tilesize.cache", std::ios::app);
+	cacheOut << tileSizeX << " " << tileSizeY << " " << device << "\n";
+}
+
+
+
+// Copies of what UploadModel() put in node_buffer, triangle_buffer and reference_buffer, for the benchmarks below
+struct UploadedTrees
+{
+	std::vector<std::vector<char>> data; // As uploaded, per blas
+	std::vector<std::vector<BLAS::Node>> nodes;
+	std::vector<std::vector<Triangle>> triangles;
+	std::vector<std::vector<int>> references; // Empty if the leaves index the triangles directly
+	BLAS::NodeLayout layout;
+};
+
+UploadedTrees ReadUploadedTrees()
+{
+	GLuint nodeBuffer = GetRegisteredBuffer("node_buffer");
+	GLuint triangleBuffer = GetRegisteredBuffer("triangle_buffer");
+	const size_t nodeSize = BLAS::uploadPairNodes ? sizeof(BLAS::PairNode) : sizeof(BLAS::Node);
+	UploadedTrees trees;
+	// Pair nodes are turned back into a DepthFirst tree of plain nodes
+	trees.layout = BLAS::uploadPairNodes ? BLAS::NodeLayout::DepthFirst : BLAS::uploadLayout;
+	for (const UploadedBLAS& blas : uploadedBLASes)
+	{
+		trees.data.push_back(std::vector<char>(nodeSize * blas.nodeCount));
+		glGetNamedBufferSubData(nodeBuffer, 16 + nodeSize * blas.nodeOffset, nodeSize * blas.nodeCount, trees.data.back().data());
+		if (BLAS::uploadPairNodes)
+		{
+			const BLAS::PairNode* pairs = (const BLAS::PairNode*)trees.data.back().data();
+			trees.nodes.push_back(BLAS::FromPairNodes(std::vector<BLAS::PairNode>(pairs, pairs + blas.nodeCount)));
+		}
+		else
+		{
+			const BLAS::Node* nodes = (const BLAS::Node*)trees.data.back().data();
+			trees.nodes.push_back(std::vector<BLAS::Node>(nodes, nodes + blas.nodeCount));
+		}
+		trees.triangles.push_back(std::vector<Triangle>(blas.triCount));
+		glGetNamedBufferSubData(triangleBuffer, 16 + sizeof(Triangle) * blas.triOffset, sizeof(Triangle) * blas.triCount, trees.triangles.back().data());
+		trees.references.push_back(std::vector<int>(blas.referenceCount));
+		if (blas.referenceCount > 0)
+			glGetNamedBufferSubData(GetRegisteredBuffer("reference_buffer"), 16 + sizeof(int) * blas.referenceOffset, sizeof(int) * blas.referenceCount, trees.references.back().data());
+	}
+	return trees;
+}
+
+// Replaces the nodes of a blas in node_buffer, the node count must not change
+void UploadTree(int blas, const std::vector<BLAS::Node>& nodes, BLAS::NodeLayout layout)
+{
+	GLuint nodeBuffer = GetRegisteredBuffer("node_buffer");
+	if (BLAS::uploadPairNodes)
+	{
+		std::vector<BLAS::PairNode> pairs = BLAS::ToPairNodes(nodes, layout);
+		glNamedBufferSubData(nodeBuffer, 16 + sizeof(BLAS::PairNode) * uploadedBLASes[blas].nodeOffset, sizeof(BLAS::PairNode) * pairs.size(), pairs.data());
+	}
+	else
+	{
+		glNamedBufferSubData(nodeBuffer, 16 + sizeof(BLAS::Node) * uploadedBLASes[blas].nodeOffset, sizeof(BLAS::Node) * nodes.size(), nodes.data());
+	}
+}
+
+void RestoreUploadedTrees(const UploadedTrees& trees)
+{
+	const size_t nodeSize = BLAS::uploadPairNodes ? sizeof(BLAS::PairNode) : sizeof(BLAS::Node);
+	for (int i = 0; i < trees.data.size(); i++)
+		glNamedBufferSubData(GetRegisteredBuffer("node_buffer"), 16 + nodeSize * uploadedBLASes[i].nodeOffset, trees.data[i].size(), trees.data[i].data());
+}
+
+// Average gpu time of comp.glsl in milliseconds
+double TimeRayTrace(GLuint program)
+{
+	const int warmupFrames = 2;
+	const int timedFrames = 5;
+
+	GLuint query;
+	glGenQueries(1, &query);
+	glUseProgram(program);
+	GLuint64 totalTime = 0;
+	for (int frame = 0; frame < warmupFrames + timedFrames; frame++)
+	{
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		DispatchRayTrace();
+		glEndQuery(GL_TIME_ELAPSED);
+		GLuint64 time = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &time);
+		if (frame >= warmupFrames)
+			totalTime += time;
+	}
+	glDeleteQueries(1, &query);
+	return (double)totalTime / timedFrames / 1000000.0;
+}
+
+// Primary rays of the current view against the rings and the trees with BLAS::IntersectRay(),
+// built like create_camera_ray() in comp_common.glsl
+BLAS::TraversalStats TraceTreesOnCPU(const std::vector<std::vector<BLAS::Node>>& nodes, const UploadedTrees& trees, BLAS::NodeLayout layout, double* out_time)
+{
+	glm::mat4 cameraToWorld = g_camera.GetViewMatrix();
+	glm::vec2 viewportScale = g_camera.GetViewportScale();
+	glm::vec3 cameraPos = glm::vec3(glm::vec4(0, 0, 0, 1) * cameraToWorld);
+
+	BLAS::TraversalStats stats;
+	double startTime = glfwGetTime();
+	for (int y = 0; y < renderHeight; y++)
+	{
+		for (int x = 0; x < renderWidth; x++)
+		{
+			glm::vec2 uv = glm::vec2(x, y) / glm::vec2(renderWidth, renderHeight) * 2.0f - 1.0f;
+			glm::vec3 dir = glm::normalize(glm::vec3(glm::vec4(uv * viewportScale, 1, 1) * cameraToWorld) - cameraPos);
+			// The rings replace the floor triangles, without them the rays would go on through the floor
+			float closest = RayTerrainsDist(cameraPos, dir, RayRingsDist(cameraPos, dir));
+			for (int i = 0; i < nodes.size(); i++)
+			{
+				glm::vec3 localPos = glm::vec3(glm::vec4(cameraPos, 1) * uploadedBLASes[i].worldToLocalMatrix);
+				glm::vec3 localDir = glm::vec3(glm::vec4(dir, 0) * uploadedBLASes[i].worldToLocalMatrix);
+				closest = BLAS::IntersectRay(nodes[i], trees.triangles[i], trees.references[i], layout, localPos, localDir, closest, &stats);
+			}
+		}
+	}
+	*out_time = (glfwGetTime() - startTime) * 1000.0;
+	return stats;
+}
+
+// Traces the current view with every BLAS::NodeLayout on the cpu and gpu, then puts the
+// uploaded layout back
+void BenchmarkNodeLayouts()
+{
+	UploadedTrees trees = ReadUploadedTrees();
+
+	const BLAS::NodeLayout layouts[] = {
+		BLAS::NodeLayout::Build,
+		BLAS::NodeLayout::BreadthFirst,
+		BLAS::NodeLayout::DepthFirst,
+		BLAS::NodeLayout::LeftChildImplicit,
+		BLAS::NodeLayout::Treelet,
+	};
+	const char* const layoutNames[] = { "Build", "BreadthFirst", "DepthFirst", "LeftChildImplicit", "Treelet" };
+	long long rayCount = (long long)renderWidth * renderHeight;
+
+	for (int l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+	{
+		std::vector<std::vector<BLAS::Node>> nodes = trees.nodes;
+		for (int i = 0; i < nodes.size(); i++)
+		{
+			BLAS::ReorderNodes(nodes[i], trees.layout, layouts[l]);
+			UploadTree(i, nodes[i], layouts[l]);
+		}
+
+		double cpuTime = 0;
+		BLAS::TraversalStats stats = TraceTreesOnCPU(nodes, trees, layouts[l], &cpuTime);
+
+		ShaderOptions options = rayTraceOptions;
+		options["BVH_LEFT_CHILD_IMPLICIT"] = !BLAS::uploadPairNodes && layouts[l] == BLAS::NodeLayout::LeftChildImplicit ? "1" : "0";
+		double gpuTime = TimeRayTrace(CreateRayTraceProgram(tileSizeX, tileSizeY, options));
+
+		std::cout << layoutNames[l] << (layouts[l] == BLAS::uploadLayout ? " (uploaded)" : "") << ": cpu "
+			<< cpuTime << "ms, "
+			<< (double)stats.nodesVisited / rayCount << " nodes/ray, "
+			<< (double)stats.cacheMisses / rayCount << " cache misses/ray, gpu "
+			<< gpuTime << "ms\n";
+	}
+
+	RestoreUploadedTrees(trees);
+}
+
+// Compares the uploaded trees with and without BLAS::OptimizeTreelets() on the cpu and gpu.
+// The optimized trees are left in node_buffer.
+void BenchmarkTreeletOptimization()
+{
+	UploadedTrees trees = ReadUploadedTrees();
+	long long rayCount = (long long)renderWidth * renderHeight;
+	GLuint program = CreateRayTraceProgram(tileSizeX, tileSizeY);
+
+	float sahBefore = 0;
+	for (int i = 0; i < trees.nodes.size(); i++)
+		sahBefore += BLAS::SAHCost(trees.nodes[i], trees.layout);
+	double cpuTimeBefore = 0;
+	BLAS::TraversalStats statsBefore = TraceTreesOnCPU(trees.nodes, trees, trees.layout, &cpuTimeBefore);
+	double gpuTimeBefore = TimeRayTrace(program);
+
+	std::vector<std::vector<BLAS::Node>> nodes = trees.nodes;
+	float sahAfter = 0;
+	double optimizeTime = glfwGetTime();
+	for (int i = 0; i < nodes.size(); i++)
+	{
+		BLAS::OptimizeTreeletNodes(nodes[i], trees.layout);
+		sahAfter += BLAS::SAHCost(nodes[i], BLAS::NodeLayout::DepthFirst);
+		BLAS::ReorderNodes(nodes[i], BLAS::NodeLayout::DepthFirst, BLAS::uploadLayout);
+		UploadTree(i, nodes[i], BLAS::uploadLayout);
+	}
+	optimizeTime = glfwGetTime() - optimizeTime;
+	double cpuTimeAfter = 0;
+	BLAS::TraversalStats statsAfter = TraceTreesOnCPU(nodes, trees, BLAS::uploadLayout, &cpuTimeAfter);
+	double gpuTimeAfter = TimeRayTrace(program);
+
+	std::cout << "Treelet optimization took " << optimizeTime * 1000.0 << "ms\n";
+	std::cout << "Before: sah " << sahBefore << ", cpu " << cpuTimeBefore << "ms, "
+		<< (double)statsBefore.nodesVisited / rayCount << " nodes/ray, gpu " << gpuTimeBefore << "ms\n";
+	std::cout << "After:  sah " << sahAfter << ", cpu " << cpuTimeAfter << "ms, "
+		<< (double)statsAfter.nodesVisited / rayCount << " nodes/ray, gpu " << gpuTimeAfter << "ms\n";
+}
+
+
+
+// All the images must have the size of the first one
+static GLuint LoadTextureArray(const char* const* filepaths, int count)
+{
+	int width = 0;
+	int height = 0;
+	std::vector<unsigned char> texels;
+	for (int i = 0; i < count; i++)
+	{
+		int layerWidth = 0;
+		int layerHeight = 0;
+		int nrChannels = 0;
+		unsigned char* data = stbi_load(filepaths[i], &layerWidth, &layerHeight, &nrChannels, 4);
+		if (!data || (i > 0 && (layerWidth != width || layerHeight != height)))
+		{
+			std::cout << "Could not load the material texture " << filepaths[i] << "!\n";
+			stbi_image_free(data);
+			return 0;
+		}
+		width = layerWidth;
+		height = layerHeight;
+		texels.insert(texels.end(), data, data + width * height * 4);
+		stbi_image_free(data);
+	}
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, width, height, count, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data());
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	return texture;
+}
+
 bool ProgramInit()
 {
-	GLuint vertexShader = CreateShader(GL_VERTEX_SHADER, "vert.glsl");
-	GLuint fragmentShader = CreateShader(GL_FRAGMENT_SHADER, "frag.glsl");
-	screenQuadProgram = CreateProgram(vertexShader, fragmentShader);
+	// GL only guarantees 8 storage blocks per compute shader. comp.glsl uses bindings 4-9 and 15-20,
+	// the wavefront kernels 4-9, 10-14 and 16-20.
+	const int storageBlocksNeeded = WAVEFRONT ? 16 : 12;
+	int maxStorageBlocks = 0;
+	glGetIntegerv(GL_MAX_COMPUTE_SHADER_STORAGE_BLOCKS, &maxStorageBlocks);
+	if (maxStorageBlocks < storageBlocksNeeded)
+	{
+		std::cout << "The ray tracing kernels need " << storageBlocksNeeded << " shader storage blocks, the GPU only allows "
+			<< maxStorageBlocks << " in a compute shader!\n";
+		return false;
+	}
+
+	// Overlaps the shader compiles, texture loads and the other scene uploads below
+	StartLoadingModels();
+
+	screenQuadProgram = LoadProgram("vert.glsl", "frag.glsl");
 	SetUniform(screenQuadProgram, "gAlbedoSpecular", 0);
 	SetUniform(screenQuadProgram, "gPosition", 1);
 	SetUniform(screenQuadProgram, "gNormal", 2);
 	SetUniform(screenQuadProgram, "gDepth", 3);
 	SetUniform(screenQuadProgram, "testTexture", 4);
 
-	GLuint computeShader = CreateShader(GL_COMPUTE_SHADER, "comp.glsl");
-	rayTraceProgram = CreateProgram(computeShader);
-	SetUniform(rayTraceProgram, "gAlbedoSpecular", 0);
-	SetUniform(rayTraceProgram, "gPosition", 1);
-	SetUniform(rayTraceProgram, "gNormal", 2);
-	SetUniform(rayTraceProgram, "gDepth", 3);
-	SetUniform(rayTraceProgram, "testTexture", 4);
+	rayTraceProgram = CreateRayTraceProgram(tileSizeX, tileSizeY);
 
 	// Create the G-BUFFER oh yes
 
@@ -166,10 +582,35 @@ bool ProgramInit()
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, testTextureWidth, testTextureHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
 	glGenerateMipmap(GL_TEXTURE_2D);
 	stbi_image_free(data);
+	RegisterTexture("testTexture", testTexture);
+
+	// The layers of the materials, see InitMaterialData()
+	const char* const materialTextureFiles[] = { "grass.png" };
+	GLuint materialTextures = LoadTextureArray(materialTextureFiles, sizeof(materialTextureFiles) / sizeof(materialTextureFiles[0]));
+	if (!materialTextures)
+		return false;
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, materialTextures);
+	RegisterTexture("materialTextures", materialTextures);
 
 
+	// The benchmark optimizes the uploaded trees itself
+	if (BENCHMARK_TREELET_OPTIMIZATION)
+		BLAS::optimizeTreelets = false;
 	InitSphereData();
-	InitModelBuffers();
+	InitRingData();
+	InitMaterialData();
+	InitCapsuleData();
+	InitTerrainData();
+	if (!InitPrimitiveBuffers())
+		return false;
+	if (!InitModelBuffers())
+		return false;
+	ReleaseStagingBuffer();
+	PrintHostMemory("after loading the scene");
+
+	if (WAVEFRONT)
+		WavefrontInit(renderWidth, renderHeight, rayTraceOptions);
 
 
 
@@ -177,8 +618,35 @@ bool ProgramInit()
 	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxWorkGroups);
 	std::cout << "glGet() = " << maxWorkGroups << "\n";
 
+	tileCounterBuffer = CreateRegisteredBuffer("tile_counter", GL_SHADER_STORAGE_BUFFER, 15, sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+
+	// Only nvidia tells us how many multiprocessors there are, otherwise guess
+	int extensionCount = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+	for (int i = 0; i < extensionCount; i++)
+	{
+		if (std::string((const char*)glGetStringi(GL_EXTENSIONS, i)) == "GL_NV_shader_thread_group")
+			glGetIntegerv(GL_SM_COUNT_NV, &multiprocessorCount);
+	}
+	std::cout << "Multiprocessors = " << multiprocessorCount << "\n";
+
+	frameDataBuffer = DynamicBuffer("frame_data", GL_UNIFORM_BUFFER, 0, sizeof(FrameData));
+
 	g_camera.m_position.y = -2900;
 
+	if (!WAVEFRONT)
+	{
+		UpdateFrameData(0);
+		AutoTuneTileSize();
+		if (BENCHMARK_NODE_LAYOUTS)
+			BenchmarkNodeLayouts();
+		if (BENCHMARK_TREELET_OPTIMIZATION)
+			BenchmarkTreeletOptimization();
+		rayTraceProgram = CreateRayTraceProgram(tileSizeX, tileSizeY);
+	}
+
+	PrintGPUMemoryReport();
+
 	return true;
 }
 
@@ -203,9 +671,9 @@ void ProgramLoop()
 	
 	g_camera.UpdateMovement();
 
-	glUseProgram(rayTraceProgram);
-	SetUniform(rayTraceProgram, "cameraToWorld", g_camera.GetViewMatrix());
-	SetUniform(rayTraceProgram, "viewportScale", g_camera.GetViewportScale());
+	BeginDynamicFrame();
+	UpdateFrameData(frameCount);
+	UpdateModelBuffer();
 
 	/*glm::mat4 printMatrix = cameraToWorld;
 	std::cout << "\n\n\nEy\n";
@@ -219,7 +687,10 @@ void ProgramLoop()
 
         glUseProgram(rayTraceProgram);
 	perf_raytrace = glfwGetTime();
-        glDispatchCompute((GLuint)renderWidth / 32, (GLuint)renderHeight / 30, 1);
+	if (WAVEFRONT)
+		WavefrontDispatch(renderWidth, renderHeight);
+	else
+		DispatchRayTrace();
 	perf_raytrace = glfwGetTime() - perf_raytrace;
 
         // make sure writing to image has finished before read
@@ -231,6 +702,7 @@ void ProgramLoop()
 	perf_lighting = glfwGetTime();
         RenderQuad();
 	perf_lighting = glfwGetTime() - perf_lighting;
+	EndDynamicFrame();
 
 	
 
@@ -283,4 +755,5 @@ void ProgramLoop()
 
 void ProgramQuit()
 {
+	DeleteAllRegisteredBuffers();
 }
@@ -0,0 +1,329 @@
+#include "terrain.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "buffer.hpp"
+#include "bvh.hpp"
+#include "stbi_image.h"
+
+
+
+int TerrainTile::MipLevels() const
+{
+	int levels = 1;
+	while ((cellCount >> (levels - 1)) > 1)
+		levels++;
+	return levels;
+}
+
+int TerrainTile::MipOffset(int level) const
+{
+	// Sum of the (cellCount >> l)^2 blocks of the levels before
+	int blocks = cellCount >> level;
+	return 4 * (cellCount * cellCount - blocks * blocks) / 3;
+}
+
+
+
+static float HashGridPoint(int x, int y, unsigned int seed)
+{
+	unsigned int h = seed;
+	h ^= (unsigned int)x * 0x27d4eb2du;
+	h = (h ^ (h >> 15)) * 0x85ebca6bu;
+	h ^= (unsigned int)y * 0x165667b1u;
+	h = (h ^ (h >> 13)) * 0xc2b2ae35u;
+	h ^= h >> 16;
+	return (h & 0xFFFFFF) / float(0xFFFFFF);
+}
+
+static float ValueNoise(float x, float y, unsigned int seed)
+{
+	int x0 = (int)std::floor(x);
+	int y0 = (int)std::floor(y);
+	float fx = x - x0;
+	float fy = y - y0;
+	fx = fx * fx * (3.0f - 2.0f * fx);
+	fy = fy * fy * (3.0f - 2.0f * fy);
+	float bottom = glm::mix(HashGridPoint(x0, y0, seed), HashGridPoint(x0 + 1, y0, seed), fx);
+	float top = glm::mix(HashGridPoint(x0, y0 + 1, seed), HashGridPoint(x0 + 1, y0 + 1, seed), fx);
+	return glm::mix(bottom, top, fy);
+}
+
+std::vector<float> GenerateHeightmap(int size, float amplitude, unsigned int seed)
+{
+	const int octaves = 6;
+	std::vector<float> heights((size + 1) * (size + 1));
+	for (int y = 0; y <= size; y++)
+	{
+		for (int x = 0; x <= size; x++)
+		{
+			float u = x / (float)size;
+			float v = y / (float)size;
+
+			float height = 0.0f;
+			float weight = 0.5f;
+			float frequency = 3.0f;
+			for (int octave = 0; octave < octaves; octave++)
+			{
+				height += ValueNoise(u * frequency, v * frequency, seed + octave) * weight;
+				weight *= 0.5f;
+				frequency *= 2.0f;
+			}
+			// Sharper peaks and wider valleys
+			height *= height;
+
+			// Down to zero at the edges so the tile meets the floor
+			float edge = std::max(std::abs(u * 2.0f - 1.0f), std::abs(v * 2.0f - 1.0f));
+			float falloff = glm::smoothstep(1.0f, 0.6f, edge);
+			heights[y * (size + 1) + x] = height * falloff * amplitude;
+		}
+	}
+	return heights;
+}
+
+std::vector<float> LoadHeightmap(const char* filepath, float amplitude, int* out_size)
+{
+	int width, height, channels;
+	unsigned char* data = stbi_load(filepath, &width, &height, &channels, 1);
+	if (!data)
+		return std::vector<float>();
+
+	int size = 1;
+	while (size * 2 + 1 <= std::min(width, height))
+		size *= 2;
+
+	std::vector<float> heights((size + 1) * (size + 1));
+	for (int y = 0; y <= size; y++)
+		for (int x = 0; x <= size; x++)
+			heights[y * (size + 1) + x] = data[y * width + x] / 255.0f * amplitude;
+
+	stbi_image_free(data);
+	*out_size = size;
+	return heights;
+}
+
+
+
+static unsigned int QuantizeNormal(float component)
+{
+	return (unsigned int)glm::clamp((component + 1.0f) * 128.0f, 0.0f, 255.0f);
+}
+
+static unsigned int QuantizeWeight(float weight)
+{
+	return (unsigned int)glm::clamp(weight * 255.0f + 0.5f, 0.0f, 255.0f);
+}
+
+TerrainTile CreateTerrainTile(const std::vector<float>& heights, int cellCount, float cellSize)
+{
+	TerrainTile tile;
+	tile.cellCount = cellCount;
+	tile.cellSize = cellSize;
+	tile.cellSteps = 65535 / cellCount;
+	tile.minHeight = *std::min_element(heights.begin(), heights.end());
+	tile.maxHeight = *std::max_element(heights.begin(), heights.end());
+	// Keeps the height scale above zero for flat tiles
+	if (tile.maxHeight <= tile.minHeight)
+		tile.maxHeight = tile.minHeight + 1.0f;
+
+	int points = cellCount + 1;
+	std::vector<unsigned int> quantizedHeights(points * points);
+	std::vector<unsigned int> normals(points * points);
+	std::vector<unsigned int> rockWeights(points * points);
+	for (int y = 0; y < points; y++)
+	{
+		for (int x = 0; x < points; x++)
+		{
+			int i = y * points + x;
+			quantizedHeights[i] = (unsigned int)((heights[i] - tile.minHeight) / tile.HeightScale() + 0.5f);
+
+			// Central differences, one sided at the edges
+			int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, cellCount);
+			int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, cellCount);
+			float dx = (heights[y * points + x1] - heights[y * points + x0]) / ((x1 - x0) * cellSize);
+			float dy = (heights[y1 * points + x] - heights[y0 * points + x]) / ((y1 - y0) * cellSize);
+			glm::vec3 normal = glm::normalize(glm::vec3(-dx, -dy, 1.0f));
+			normals[i] = QuantizeNormal(normal.x) | QuantizeNormal(normal.y) << 8 | QuantizeNormal(normal.z) << 16;
+			// Steep slopes blend from grass towards rock
+			rockWeights[i] = QuantizeWeight(glm::smoothstep(0.85f, 0.65f, normal.z));
+		}
+	}
+
+	tile.triangles.resize(cellCount * cellCount * 2);
+	for (int y = 0; y < cellCount; y++)
+	{
+		for (int x = 0; x < cellCount; x++)
+		{
+			int corners[2][3][2] = {
+				{ { x, y }, { x + 1, y }, { x + 1, y + 1 } },
+				{ { x, y }, { x + 1, y + 1 }, { x, y + 1 } },
+			};
+			for (int half = 0; half < 2; half++)
+			{
+				unsigned int position[3];
+				unsigned int z[3];
+				unsigned int normal[3];
+				unsigned int weight[3];
+				for (int vertex = 0; vertex < 3; vertex++)
+				{
+					int cx = corners[half][vertex][0];
+					int cy = corners[half][vertex][1];
+					int i = cy * points + cx;
+					position[vertex] = (cx * tile.cellSteps) | (cy * tile.cellSteps) << 16;
+					z[vertex] = quantizedHeights[i];
+					normal[vertex] = normals[i];
+					weight[vertex] = rockWeights[i];
+				}
+
+				TerrainTriangle& tri = tile.triangles[(y * cellCount + x) * 2 + half];
+				tri.Ax_Ay = position[0];
+				tri.Bx_By = position[1];
+				tri.Cx_Cy = position[2];
+				tri.Az_Bz = z[0] | z[1] << 16;
+				tri.Cz_Anx_Any = z[2] | (normal[0] & 0xFFFF) << 16;
+				tri.Anz_Bnx_Bny_Bnz = normal[0] >> 16 | normal[1] << 8;
+				tri.Cnx_Cny_Cnz_id1 = normal[2] | MATERIAL_GRASS << 24;
+				tri.At_Bt_Ct_id2 = weight[0] | weight[1] << 8 | weight[2] << 16 | MATERIAL_ROCK << 24;
+			}
+		}
+	}
+
+	// Level 0 from the corners of each cell, then every level from the 2x2 blocks below it
+	int levels = tile.MipLevels();
+	tile.minMaxMips.resize(tile.MipOffset(levels));
+	for (int y = 0; y < cellCount; y++)
+	{
+		for (int x = 0; x < cellCount; x++)
+		{
+			unsigned int corners[4] = {
+				quantizedHeights[y * points + x],
+				quantizedHeights[y * points + x + 1],
+				quantizedHeights[(y + 1) * points + x],
+				quantizedHeights[(y + 1) * points + x + 1],
+			};
+			unsigned int low = *std::min_element(corners, corners + 4);
+			unsigned int high = *std::max_element(corners, corners + 4);
+			tile.minMaxMips[y * cellCount + x] = low | high << 16;
+		}
+	}
+	for (int level = 1; level < levels; level++)
+	{
+		int blocks = cellCount >> level;
+		unsigned int* below = &tile.minMaxMips[tile.MipOffset(level - 1)];
+		unsigned int* current = &tile.minMaxMips[tile.MipOffset(level)];
+		for (int y = 0; y < blocks; y++)
+		{
+			for (int x = 0; x < blocks; x++)
+			{
+				unsigned int low = 0xFFFF;
+				unsigned int high = 0;
+				for (int child = 0; child < 4; child++)
+				{
+					unsigned int minMax = below[(y * 2 + (child >> 1)) * blocks * 2 + x * 2 + (child & 1)];
+					low = std::min(low, minMax & 0xFFFF);
+					high = std::max(high, minMax >> 16);
+				}
+				current[y * blocks + x] = low | high << 16;
+			}
+		}
+	}
+
+	return tile;
+}
+
+
+
+glm::mat4 PlaceTerrainOnRing(const TerrainTile& tile, const Ring& ring, float angle, float axialPosition)
+{
+	// Tile x along the ring axis, y along the band and z towards the axis
+	glm::vec3 touch = glm::vec3(std::cos(angle), std::sin(angle), 0.0f) * ring.innerRadius + glm::vec3(0, 0, axialPosition);
+	glm::vec3 axisX = glm::vec3(0, 0, 1);
+	glm::vec3 axisY = glm::vec3(-std::sin(angle), std::cos(angle), 0.0f);
+	glm::vec3 axisZ = glm::vec3(-std::cos(angle), -std::sin(angle), 0.0f);
+	float halfSize = tile.cellCount * tile.cellSize / 2.0f;
+	glm::vec3 origin = touch - axisX * halfSize - axisY * halfSize;
+
+	// Rows are the images of the tile axes, vectors are multiplied from the left
+	glm::mat4 tileToRing = glm::transpose(glm::mat4(
+		glm::vec4(axisX, 0.0f),
+		glm::vec4(axisY, 0.0f),
+		glm::vec4(axisZ, 0.0f),
+		glm::vec4(origin, 1.0f)));
+	return glm::inverse(tileToRing * ring.localToWorldMatrix);
+}
+
+
+
+static Triangle DecodeTerrainTriangle(const TerrainTile& tile, const TerrainTriangle& tri)
+{
+	float positionScale = tile.cellSize / tile.cellSteps;
+	float heightScale = tile.HeightScale();
+	Triangle decoded{};
+	decoded.vertA = glm::vec4((tri.Ax_Ay & 0xFFFF) * positionScale, (tri.Ax_Ay >> 16) * positionScale, tile.minHeight + (tri.Az_Bz & 0xFFFF) * heightScale, 0.0f);
+	decoded.vertB = glm::vec4((tri.Bx_By & 0xFFFF) * positionScale, (tri.Bx_By >> 16) * positionScale, tile.minHeight + (tri.Az_Bz >> 16) * heightScale, 0.0f);
+	decoded.vertC = glm::vec4((tri.Cx_Cy & 0xFFFF) * positionScale, (tri.Cx_Cy >> 16) * positionScale, tile.minHeight + (tri.Cz_Anx_Any & 0xFFFF) * heightScale, 0.0f);
+	return decoded;
+}
+
+float RayTerrainDist(const TerrainTile& tile, glm::vec3 origin, glm::vec3 dir, float maxDist)
+{
+	float size = tile.cellCount * tile.cellSize;
+	glm::vec3 invDir = 1.0f / dir;
+	glm::vec3 t1 = (glm::vec3(0, 0, tile.minHeight) - origin) * invDir;
+	glm::vec3 t2 = (glm::vec3(size, size, tile.maxHeight) - origin) * invDir;
+	glm::vec3 tMin = glm::min(t1, t2);
+	glm::vec3 tMax = glm::max(t1, t2);
+	float t = std::max(std::max(std::max(tMin.x, tMin.y), tMin.z), 0.0f);
+	float tFar = std::min(std::min(std::min(tMax.x, tMax.y), tMax.z), maxDist);
+	if (t > tFar)
+		return INFINITY;
+
+	int levels = tile.MipLevels();
+	int level = levels - 1;
+	float heightScale = tile.HeightScale();
+	// Points on a block boundary belong to the block the ray enters
+	glm::vec2 nudge = glm::sign(glm::vec2(dir)) * tile.cellSize * 0.001f;
+	int maxSteps = 4 * tile.cellCount + 2 * levels + 8;
+
+	for (int step = 0; step < maxSteps; step++)
+	{
+		int blocks = tile.cellCount >> level;
+		float blockSize = tile.cellSize * (1 << level);
+		glm::vec2 pos = glm::vec2(origin) + glm::vec2(dir) * t + nudge;
+		glm::ivec2 block = glm::clamp(glm::ivec2(glm::floor(pos / blockSize)), glm::ivec2(0), glm::ivec2(blocks - 1));
+
+		float tExit = tFar;
+		if (dir.x != 0)
+			tExit = std::min(tExit, ((block.x + (dir.x > 0 ? 1 : 0)) * blockSize - origin.x) * invDir.x);
+		if (dir.y != 0)
+			tExit = std::min(tExit, ((block.y + (dir.y > 0 ? 1 : 0)) * blockSize - origin.y) * invDir.y);
+
+		unsigned int minMax = tile.minMaxMips[tile.MipOffset(level) + block.y * blocks + block.x];
+		float blockMin = tile.minHeight + (minMax & 0xFFFF) * heightScale;
+		float blockMax = tile.minHeight + (minMax >> 16) * heightScale;
+		float enterHeight = origin.z + dir.z * t;
+		float exitHeight = origin.z + dir.z * tExit;
+		if (std::min(enterHeight, exitHeight) <= blockMax && std::max(enterHeight, exitHeight) >= blockMin)
+		{
+			if (level > 0)
+			{
+				level--;
+				continue;
+			}
+			// The triangles lie inside the cell so the first cell with a hit has the closest one
+			int cell = (block.y * tile.cellCount + block.x) * 2;
+			float dist = std::min(
+				RayTriangleDist(origin, dir, DecodeTerrainTriangle(tile, tile.triangles[cell])),
+				RayTriangleDist(origin, dir, DecodeTerrainTriangle(tile, tile.triangles[cell + 1])));
+			if (dist < maxDist)
+				return dist;
+		}
+
+		if (tExit >= tFar)
+			break;
+		t = tExit;
+		level = std::min(level + 1, levels - 1);
+	}
+	return INFINITY;
+}
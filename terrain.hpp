@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+struct Ring;
+
+
+
+// Layout from bits.txt, 16 bit positions quantized over the tile, 8 bit normals, the materials
+// id1 and id2 of the triangle and the blend weight t towards id2 at each vertex
+struct TerrainTriangle
+{
+	unsigned int Ax_Ay;
+	unsigned int Bx_By;
+	unsigned int Cx_Cy;
+	unsigned int Az_Bz;
+	unsigned int Cz_Anx_Any;
+	unsigned int Anz_Bnx_Bny_Bnz;
+	unsigned int Cnx_Cny_Cnz_id1;
+	unsigned int At_Bt_Ct_id2;
+};
+
+// Square heightfield of cellCount x cellCount cells with two triangles each. The tile spans
+// 0 to cellCount * cellSize along local x and y, heights are along local z.
+struct TerrainTile
+{
+	int cellCount; // Power of two
+	float cellSize;
+	float minHeight;
+	float maxHeight;
+	// Position steps of the 16 bit x and y per cell, the grid lines are exact
+	int cellSteps;
+	// Two per cell, row by row
+	std::vector<TerrainTriangle> triangles;
+	// Quantized min | max << 16 height of every cell, then of every 2x2 block of cells and so
+	// on up to one block covering the tile
+	std::vector<unsigned int> minMaxMips;
+
+	float HeightScale() const { return (maxHeight - minHeight) / 65535.0f; }
+	int MipLevels() const;
+	// Where level starts in minMaxMips
+	int MipOffset(int level) const;
+};
+
+// Heights of (size + 1) x (size + 1) grid points, size must be a power of two
+std::vector<float> GenerateHeightmap(int size, float amplitude, unsigned int seed);
+// The biggest power of two square of grid points that fits in the grayscale image, scaled
+// to 0 - amplitude. Empty if the image could not be loaded.
+std::vector<float> LoadHeightmap(const char* filepath, float amplitude, int* out_size);
+
+TerrainTile CreateTerrainTile(const std::vector<float>& heights, int cellCount, float cellSize);
+
+// Transform of a tile lying on the floor of the ring, with its centre at angle around the ring
+// axis and axialPosition along it. The tile is flat, its middle touches the floor and local z
+// points towards the axis.
+glm::mat4 PlaceTerrainOnRing(const TerrainTile& tile, const Ring& ring, float angle, float axialPosition);
+
+// Distance along dir to the closest hit with the tile in its local space, INFINITY if there is
+// none. Traverses like ray_terrain_intersection() in comp_common.glsl.
+float RayTerrainDist(const TerrainTile& tile, glm::vec3 origin, glm::vec3 dir, float maxDist);
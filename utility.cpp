@@ -1,10 +1,27 @@
+#ifdef _WIN32
+// Before glad so it doesn't fight windows.h over APIENTRY
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
 #include "utility.hpp"
 
 #include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <vector>
 
 
 
-std::string ReadShaderFile(const char* filepath)
+// includeStack has the files being read down to filepath, including one of them again is a cycle
+// and an error. includedFiles has every file read so far, those are left out if included again.
+static std::string ReadShaderFile(const char* filepath, std::vector<std::string>& includeStack, std::set<std::string>& includedFiles)
 {
 	// Retrieve the source code from filePath
 	std::string shaderCode;
@@ -26,7 +43,47 @@ std::string ReadShaderFile(const char* filepath)
 	{
 		std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
 	}
-	return shaderCode;
+
+	// Replace #include "file" lines with the contents of that file
+	std::string resolvedCode;
+	std::istringstream codeStream(shaderCode);
+	std::string line;
+	while (std::getline(codeStream, line))
+	{
+		size_t includeStart = line.find("#include \"");
+		if (includeStart == 0)
+		{
+			size_t nameStart = includeStart + 10;
+			size_t nameEnd = line.find('"', nameStart);
+			std::string includePath = line.substr(nameStart, nameEnd - nameStart);
+			if (std::find(includeStack.begin(), includeStack.end(), includePath) != includeStack.end())
+			{
+				std::cout << "ERROR::SHADER::INCLUDE_CYCLE: ";
+				for (const std::string& file : includeStack)
+					std::cout << file << " -> ";
+				std::cout << includePath << std::endl;
+			}
+			else if (includedFiles.insert(includePath).second)
+			{
+				includeStack.push_back(includePath);
+				resolvedCode += ReadShaderFile(includePath.c_str(), includeStack, includedFiles);
+				includeStack.pop_back();
+			}
+		}
+		else
+		{
+			resolvedCode += line;
+		}
+		resolvedCode += "\n";
+	}
+	return resolvedCode;
+}
+
+std::string ReadShaderFile(const char* filepath)
+{
+	std::vector<std::string> includeStack = { filepath };
+	std::set<std::string> includedFiles = { filepath };
+	return ReadShaderFile(filepath, includeStack, includedFiles);
 }
 
 
@@ -57,23 +114,79 @@ void CheckCompileErrors(GLuint shader, bool isProgram)
 
 
 
-GLuint CreateShader(GLenum type, const char* filepath)
+static std::string ShaderDefines(const ShaderOptions& options)
+{
+	std::string defines;
+	for (const auto& option : options)
+		defines += "#define " + option.first + " " + option.second + "\n";
+	return defines;
+}
+
+static std::string PreprocessShader(const char* filepath, const ShaderOptions& options)
 {
-	GLuint shader = glCreateShader(type);
 	std::string shaderSource = ReadShaderFile(filepath);
-	const char* shaderSourceStr = shaderSource.c_str();
+	// All shaders start with the #version line which has to stay first
+	shaderSource.insert(shaderSource.find('\n') + 1, ShaderDefines(options));
+	return shaderSource;
+}
+
+static GLuint CompileShader(GLenum type, const std::string& source)
+{
+	GLuint shader = glCreateShader(type);
+	const char* shaderSourceStr = source.c_str();
 	glShaderSource(shader, 1, &shaderSourceStr, NULL);
 	glCompileShader(shader);
 	CheckCompileErrors(shader, false);
 	return shader;
 }
 
+GLuint CreateShader(GLenum type, const char* filepath, const ShaderOptions& options)
+{
+	return CompileShader(type, PreprocessShader(filepath, options));
+}
+
+// Uniform locations of every linked program, so SetUniform never asks the driver by name.
+// std::less<> lets the table be searched with a const char* without making a std::string.
+static std::map<GLuint, std::map<std::string, GLint, std::less<>>> uniformLocations;
+
+static void ReflectUniforms(GLuint program)
+{
+	std::map<std::string, GLint, std::less<>>& locations = uniformLocations[program];
+	locations.clear();
+	GLint uniformCount = 0;
+	glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &uniformCount);
+	for (GLint i = 0; i < uniformCount; i++)
+	{
+		GLchar name[256];
+		glGetActiveUniformName(program, i, sizeof(name), NULL, name);
+		GLint location = glGetUniformLocation(program, name);
+		if (location < 0)
+			continue; // Uniform block members have no location
+		// Arrays are reported as name[0]
+		std::string uniformName = name;
+		size_t bracket = uniformName.find('[');
+		if (bracket != std::string::npos)
+			uniformName.resize(bracket);
+		locations[uniformName] = location;
+	}
+}
+
+GLint GetUniformLocation(GLuint program, const char* name)
+{
+	auto locations = uniformLocations.find(program);
+	if (locations == uniformLocations.end())
+		return -1;
+	auto location = locations->second.find(name);
+	return location != locations->second.end() ? location->second : -1;
+}
+
 GLuint CreateProgram(GLuint shader0)
 {
 	GLuint program = glCreateProgram();
 	glAttachShader(program, shader0);
 	glLinkProgram(program);
 	CheckCompileErrors(program, true);
+	ReflectUniforms(program);
 	glDeleteShader(shader0);
 	glUseProgram(program); // why is this needed???
 	return program;
@@ -86,27 +199,180 @@ GLuint CreateProgram(GLuint shader0, GLuint shader1)
 	glAttachShader(program, shader1);
 	glLinkProgram(program);
 	CheckCompileErrors(program, true);
+	ReflectUniforms(program);
 	glDeleteShader(shader0);
 	glDeleteShader(shader1);
 	glUseProgram(program);
 	return program;
 }
 
+// Program binaries are saved in the working directory as <hash>.programcache. The file
+// also holds the whole key so a hash collision or a driver update just recompiles.
+static const unsigned int programCacheMagic = 0x43505452; // "RTPC"
+
+static unsigned long long HashString(const std::string& str)
+{
+	// 64 bit FNV-1a
+	unsigned long long hash = 14695981039346656037ull;
+	for (unsigned char c : str)
+	{
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static GLuint LoadProgramBinary(const std::string& path, const std::string& key)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return 0;
+
+	unsigned int magic = 0;
+	GLenum format = 0;
+	unsigned int keyLength = 0;
+	file.read((char*)&magic, sizeof(magic));
+	file.read((char*)&format, sizeof(format));
+	file.read((char*)&keyLength, sizeof(keyLength));
+	if (!file || magic != programCacheMagic || keyLength != key.size())
+		return 0;
+	std::string fileKey(keyLength, '\0');
+	file.read(&fileKey[0], keyLength);
+	unsigned int binaryLength = 0;
+	file.read((char*)&binaryLength, sizeof(binaryLength));
+	if (!file || fileKey != key)
+		return 0;
+	std::vector<char> binary(binaryLength);
+	file.read(binary.data(), binaryLength);
+	if (!file)
+		return 0;
+
+	// The driver may still reject the binary, then it is compiled from source again
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, format, binary.data(), binaryLength);
+	GLint success = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success)
+	{
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+static void SaveProgramBinary(GLuint program, const std::string& path, const std::string& key)
+{
+	GLint binaryLength = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binaryLength);
+	if (binaryLength <= 0)
+		return;
+	std::vector<char> binary(binaryLength);
+	GLenum format = 0;
+	glGetProgramBinary(program, binaryLength, NULL, &format, binary.data());
+
+	std::ofstream file(path, std::ios::binary);
+	unsigned int keyLength = (unsigned int)key.size();
+	unsigned int length = (unsigned int)binaryLength;
+	file.write((const char*)&programCacheMagic, sizeof(programCacheMagic));
+	file.write((const char*)&format, sizeof(format));
+	file.write((const char*)&keyLength, sizeof(keyLength));
+	file.write(key.data(), keyLength);
+	file.write((const char*)&length, sizeof(length));
+	file.write(binary.data(), binaryLength);
+}
+
+// Links a program from the shader files, or loads the binary from a previous run if
+// neither the preprocessed sources (which include the options) nor the driver changed
+static GLuint CreateCachedProgram(int shaderCount, const GLenum* types, const char* const* filepaths, const ShaderOptions& options)
+{
+	double startTime = glfwGetTime();
+
+	std::string name = filepaths[0];
+	std::string key =
+		std::string((const char*)glGetString(GL_VENDOR)) + "\n" +
+		std::string((const char*)glGetString(GL_RENDERER)) + "\n" +
+		std::string((const char*)glGetString(GL_VERSION)) + "\n";
+	std::vector<std::string> sources;
+	for (int i = 0; i < shaderCount; i++)
+	{
+		sources.push_back(PreprocessShader(filepaths[i], options));
+		key += sources.back();
+		if (i > 0)
+			name += std::string(" + ") + filepaths[i];
+	}
+	std::stringstream path;
+	path << std::hex << HashString(key) << ".programcache";
+
+	GLuint program = LoadProgramBinary(path.str(), key);
+	if (program)
+	{
+		std::cout << "Loaded " << name << " from the program cache in " << (glfwGetTime() - startTime) * 1000.0 << "ms\n";
+		ReflectUniforms(program);
+		glUseProgram(program);
+		return program;
+	}
+
+	program = glCreateProgram();
+	std::vector<GLuint> shaders;
+	for (int i = 0; i < shaderCount; i++)
+	{
+		shaders.push_back(CompileShader(types[i], sources[i]));
+		glAttachShader(program, shaders.back());
+	}
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program);
+	CheckCompileErrors(program, true);
+	for (GLuint shader : shaders)
+		glDeleteShader(shader);
+
+	GLint success = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (success)
+		SaveProgramBinary(program, path.str(), key);
+	std::cout << "Compiled " << name << " in " << (glfwGetTime() - startTime) * 1000.0 << "ms\n";
+	ReflectUniforms(program);
+	glUseProgram(program);
+	return program;
+}
+
+GLuint LoadProgram(const char* vertexPath, const char* fragmentPath)
+{
+	const GLenum types[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	const char* const filepaths[] = { vertexPath, fragmentPath };
+	return CreateCachedProgram(2, types, filepaths, ShaderOptions());
+}
+
+static std::map<std::string, GLuint> computeVariants;
+
+GLuint GetComputeProgram(const char* filepath, const ShaderOptions& options)
+{
+	// std::map keeps the options sorted so the same set always gives the same key
+	std::string key = std::string(filepath) + "\n" + ShaderDefines(options);
+	auto variant = computeVariants.find(key);
+	if (variant != computeVariants.end())
+		return variant->second;
+
+	const GLenum type = GL_COMPUTE_SHADER;
+	GLuint program = CreateCachedProgram(1, &type, &filepath, options);
+	computeVariants[key] = program;
+	return program;
+}
+
 void SetUniform(GLuint program, const char* const name, int value)
 {
-	glUniform1i(glGetUniformLocation(program, name), value);
+	glUniform1i(GetUniformLocation(program, name), value);
 }
 void SetUniform(GLuint program, const char* const name, float value)
 {
-	glUniform1f(glGetUniformLocation(program, name), value);
+	glUniform1f(GetUniformLocation(program, name), value);
 }
 void SetUniform(GLuint program, const char* const name, const glm::vec2& vec)
 {
-	glUniform2fv(glGetUniformLocation(program, name), 1, &vec[0]);
+	glUniform2fv(GetUniformLocation(program, name), 1, &vec[0]);
 }
 void SetUniform(GLuint program, const char* const name, const glm::mat4& mat)
 {
-	glUniformMatrix4fv(glGetUniformLocation(program, name), 1, GL_FALSE, &mat[0][0]);
+	glUniformMatrix4fv(GetUniformLocation(program, name), 1, GL_FALSE, &mat[0][0]);
 }
 
 
@@ -142,6 +408,33 @@ void RenderQuad()
 
 
 
+void PrintHostMemory(const char* when)
+{
+	size_t resident = 0;
+	size_t peak = 0;
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		resident = counters.WorkingSetSize;
+		peak = counters.PeakWorkingSetSize;
+	}
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		peak = (size_t)usage.ru_maxrss * 1024;
+	std::ifstream statm("/proc/self/statm");
+	size_t pages = 0;
+	size_t residentPages = 0;
+	if (statm >> pages >> residentPages)
+		resident = residentPages * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	const double MB = 1024.0 * 1024.0;
+	std::cout << "Host memory " << when << ": " << resident / MB << " MB resident, " << peak / MB << " MB peak\n";
+}
+
+
+
 float Lerp(float a, float b, float t)
 {
 	return a + (b - a) * t;
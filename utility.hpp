@@ -4,6 +4,7 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <map>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
@@ -13,12 +14,24 @@
 
 
 
+// Preprocessor defines injected into a shader, e.g. { "TILE_SIZE_X", "16" }
+typedef std::map<std::string, std::string> ShaderOptions;
+
+// Expands #include "file" lines, a file already included is left out and include cycles are reported
 std::string ReadShaderFile(const char* filepath);
 void CheckCompileErrors(GLuint shader, bool isProgram);
-GLuint CreateShader(GLenum type, const char* filepath);
+// The options are inserted as #defines right after the #version line
+GLuint CreateShader(GLenum type, const char* filepath, const ShaderOptions& options = ShaderOptions());
 GLuint CreateProgram(GLuint shader0);
 GLuint CreateProgram(GLuint shader0, GLuint shader1);
-
+// Both of these go through the program binary cache, see CreateCachedProgram()
+GLuint LoadProgram(const char* vertexPath, const char* fragmentPath);
+// Returns the compute program for this file and option set, it is only compiled
+// the first time that combination is asked for
+GLuint GetComputeProgram(const char* filepath, const ShaderOptions& options);
+
+// Looked up in a table built when the program was linked, -1 if there is no such uniform
+GLint GetUniformLocation(GLuint program, const char* name);
 void SetUniform(GLuint program, const char* const name, int value);
 void SetUniform(GLuint program, const char* const name, float value);
 void SetUniform(GLuint program, const char* const name, const glm::vec2& vec);
@@ -26,5 +39,8 @@ void SetUniform(GLuint program, const char* const name, const glm::mat4& mat);
 
 void RenderQuad();
 
+// Prints the resident and peak resident memory of the process
+void PrintHostMemory(const char* when);
+
 float Lerp(float a, float b, float t);
 float RandomRange(float min, float max);
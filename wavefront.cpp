@@ -0,0 +1,139 @@
+#include "wavefront.hpp"
+
+#include <stddef.h>
+
+#include "buffer.hpp"
+
+
+
+// These must match comp_wavefront.glsl
+struct QueuedRay
+{
+	glm::vec3 pos;
+	int pixel;
+	glm::vec3 dir;
+	int bounce;
+	glm::vec4 color;
+	float coneWidth;
+	float coneSpread;
+	float _padding0;
+	float _padding1;
+};
+struct QueuedHit
+{
+	glm::vec3 pos;
+	float dist;
+	glm::vec3 normal;
+	int hit;
+	glm::vec4 albedoSpecular;
+	float curvature;
+	float _padding0;
+	float _padding1;
+	float _padding2;
+};
+struct ShadowRay
+{
+	glm::vec3 pos;
+	int pixel;
+	glm::vec3 normal;
+	float dist;
+	glm::vec4 albedoSpecular;
+};
+struct WavefrontCounters
+{
+	GLuint rayCount;
+	GLuint nextRayCount;
+	GLuint shadowRayCount;
+	GLuint _padding;
+	GLuint extendDispatch[4];
+	GLuint shadowDispatch[4];
+};
+
+const int wavefrontGroupSize = 64;
+int maxBounces = 3; // MIRROR_BOUNCES, the shade kernel stops spawning rays after this many
+
+
+
+GLuint generateProgram = -1;
+GLuint extendProgram = -1;
+GLuint shadeProgram = -1;
+GLuint prepareProgram = -1;
+GLuint shadowProgram = -1;
+
+GLuint counterBuffer = 0;
+GLuint rayQueueBuffers[2] = { 0, 0 };
+GLuint hitQueueBuffer = 0;
+GLuint shadowQueueBuffer = 0;
+
+
+
+static GLuint CreateQueueBuffer(const char* name, GLuint binding, GLsizeiptr datasize)
+{
+	return CreateRegisteredBuffer(name, GL_SHADER_STORAGE_BUFFER, binding, datasize, NULL, GL_DYNAMIC_COPY);
+}
+
+void WavefrontInit(int renderWidth, int renderHeight, const ShaderOptions& options)
+{
+	generateProgram = GetComputeProgram("comp_wavefront_generate.glsl", options);
+	extendProgram = GetComputeProgram("comp_wavefront_extend.glsl", options);
+	shadeProgram = GetComputeProgram("comp_wavefront_shade.glsl", options);
+	prepareProgram = GetComputeProgram("comp_wavefront_prepare.glsl", options);
+	shadowProgram = GetComputeProgram("comp_wavefront_shadow.glsl", options);
+
+	auto bounces = options.find("MIRROR_BOUNCES");
+	if (bounces != options.end())
+		maxBounces = std::stoi(bounces->second);
+
+	// Every queue can at most hold one ray per pixel
+	GLsizeiptr pixelCount = (GLsizeiptr)renderWidth * renderHeight;
+	counterBuffer = CreateQueueBuffer("wavefront_counters", 10, sizeof(WavefrontCounters));
+	rayQueueBuffers[0] = CreateQueueBuffer("ray_queue_0", 11, sizeof(QueuedRay) * pixelCount);
+	rayQueueBuffers[1] = CreateQueueBuffer("ray_queue_1", 12, sizeof(QueuedRay) * pixelCount);
+	hitQueueBuffer = CreateQueueBuffer("hit_queue", 13, sizeof(QueuedHit) * pixelCount);
+	shadowQueueBuffer = CreateQueueBuffer("shadow_queue", 14, sizeof(ShadowRay) * pixelCount);
+}
+
+void WavefrontDispatch(int renderWidth, int renderHeight)
+{
+	GLuint pixelCount = (GLuint)(renderWidth * renderHeight);
+	WavefrontCounters counters = {
+		pixelCount, 0, 0, 0,
+		{ (pixelCount + wavefrontGroupSize - 1) / wavefrontGroupSize, 1, 1, 0 },
+		{ 0, 1, 1, 0 },
+	};
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, counterBuffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), &counters);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, counterBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, rayQueueBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, hitQueueBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, shadowQueueBuffer);
+
+	glUseProgram(generateProgram);
+	glDispatchCompute((renderWidth + 7) / 8, (renderHeight + 7) / 8, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	// Only the rays still alive after each bounce are traced, the group counts are
+	// written to the counter buffer by the prepare kernel
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, counterBuffer);
+	for (int bounce = 0; bounce <= maxBounces; bounce++)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, rayQueueBuffers[bounce % 2]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, rayQueueBuffers[(bounce + 1) % 2]);
+
+		glUseProgram(extendProgram);
+		glDispatchComputeIndirect(offsetof(WavefrontCounters, extendDispatch));
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		glUseProgram(shadeProgram);
+		glDispatchComputeIndirect(offsetof(WavefrontCounters, extendDispatch));
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		glUseProgram(prepareProgram);
+		glDispatchCompute(1, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+	}
+
+	glUseProgram(shadowProgram);
+	glDispatchComputeIndirect(offsetof(WavefrontCounters, shadowDispatch));
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "utility.hpp"
+
+
+
+// Wavefront mode splits the megakernel in comp.glsl into separate generate,
+// extend, shade and shadow passes that pass rays to each other through queues
+// extendProgram and friends are compiled with the same options as comp.glsl
+void WavefrontInit(int renderWidth, int renderHeight, const ShaderOptions& options);
+
+// The camera is read from the frame_data uniform block
+void WavefrontDispatch(int renderWidth, int renderHeight);